@@ -0,0 +1,243 @@
+/* cmpbench - microbenchmark of the pairwise compare loop in finddups, across
+ *            read sizes, backends and compare kernels. Writes CSV.
+ *
+ * Copyright 2012, Alex Stangl
+ * License: OpenBSD/ISC.  See file LICENSE for full text of license.
+ *
+ * Build:  cc -O2 -pthread -DFINDDUPS_BENCH -o cmpbench bench/cmpbench.c libfinddups.c
+ *
+ * The library built with FINDDUPS_BENCH runs its own compare path (cmpFiles
+ * and the backend's reads) with the read size and kernel chosen here.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "../libfinddups.h"
+
+#define EX_USAGE 64
+
+#define DEFAULT_SIZES "65536,1048576,16777216"
+#define DEFAULT_BUFSIZES "1024,4096,16384,65536,262144,1048576"
+/* where the two files first differ, as a fraction of size; 1 means identical */
+#define DEFAULT_MISMATCH "0,0.5,1"
+
+#define MAXLIST 32
+
+static void error_exit(const char *msg, const char *parm)
+{
+	fprintf(stderr, "cmpbench: %s%s: %s\n", msg, parm ? parm : "", strerror(errno));
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parseList(const char *s, double *v)
+{
+	char *end;
+	int n;
+	for (n = 0; *s && n < MAXLIST; ++n) {
+		v[n] = strtod(s, &end);
+		if (end == s)
+			break;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return *s ? -1 : n;
+}
+
+/* Compare kernels, tried against finddups' own (memcmp, then a scan for the
+ * first difference). Each returns the index of the first differing byte, or
+ * n if the buffers are equal.
+ */
+static size_t kWord(const char *a, const char *b, size_t n)
+{
+	unsigned long long x, y;
+	size_t k;
+	for (k = 0; k + 8 <= n; k += 8) {
+		memcpy(&x, a + k, 8);
+		memcpy(&y, b + k, 8);
+		if (x != y)
+			break;
+	}
+	for (; k < n && a[k] == b[k]; ++k);
+	return k;
+}
+
+#if defined(__SSE2__)
+static size_t kSSE2(const char *a, const char *b, size_t n)
+{
+	unsigned mask;
+	size_t k;
+	for (k = 0; k + 16 <= n; k += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + k)),
+					_mm_loadu_si128((const __m128i *) (b + k))));
+		if (mask != 0xffff)
+			return k + __builtin_ctz(~mask);
+	}
+	for (; k < n && a[k] == b[k]; ++k);
+	return k;
+}
+
+__attribute__((target("avx2")))
+static size_t kAVX2(const char *a, const char *b, size_t n)
+{
+	unsigned mask;
+	size_t k;
+	for (k = 0; k + 32 <= n; k += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + k)),
+					_mm256_loadu_si256((const __m256i *) (b + k))));
+		if (mask != 0xffffffffU)
+			return k + __builtin_ctz(~mask);
+	}
+	for (; k < n && a[k] == b[k]; ++k);
+	return k;
+}
+#endif
+
+static const struct kernel {const char *name; size_t (*fn)(const char *, const char *, size_t);} kernels[] = {
+	{"memcmp", NULL},
+	{"word", kWord},
+#if defined(__SSE2__)
+	{"sse2", kSSE2},
+	{"avx2", kAVX2},
+#endif
+};
+
+static const char *backends[] = {"posix", "mmap", "io_uring"};
+
+/* time one compare of the two files, the way finddups does it: step through
+ * both in bufsize chunks until they differ. Returns bytes compared.
+ */
+static size_t compare(struct finddups *fd, const struct kernel *k, const char *pa, const char *pb,
+		size_t size, size_t bufsize, char *ba, char *bb)
+{
+	long pos = finddups_bench_compare(fd, pa, pb, size, bufsize, k->fn, ba, bb);
+	if (pos < 0)
+		error_exit("Error reading ", pa);
+	return pos;
+}
+
+static void writeFile(const char *path, const char *data, size_t size)
+{
+	int fd;
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		error_exit("Error creating ", path);
+	if (write(fd, data, size) != (ssize_t) size)
+		error_exit("Error writing ", path);
+	close(fd);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: cmpbench [-s sizes] [-b bufsizes] [-m mismatch-fractions]\n"
+			"                [-t seconds-per-cell] [-d tmpdir]\n");
+	exit(EX_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+	double sizes[MAXLIST], bufsizes[MAXLIST], mism[MAXLIST], minTime = 0.2, start, elapsed;
+	int nsizes, nbuf, nmism, c, si, bi, mi, b;
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char pa[4096], pb[4096], *data, *ba, *bb;
+	size_t size, bufsize, at, bytes;
+	struct finddups *fds[sizeof backends / sizeof backends[0]];
+	unsigned kk;
+	long reps;
+
+	nsizes = parseList(DEFAULT_SIZES, sizes);
+	nbuf = parseList(DEFAULT_BUFSIZES, bufsizes);
+	nmism = parseList(DEFAULT_MISMATCH, mism);
+	while ((c = getopt(argc, argv, "s:b:m:t:d:")) != -1) {
+		switch (c) {
+		case 's': nsizes = parseList(optarg, sizes); break;
+		case 'b': nbuf = parseList(optarg, bufsizes); break;
+		case 'm': nmism = parseList(optarg, mism); break;
+		case 't': minTime = atof(optarg); break;
+		case 'd': dir = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind != argc || nsizes < 1 || nbuf < 1 || nmism < 1)
+		usage();
+
+	for (b = 0; b < (int) (sizeof backends / sizeof backends[0]); ++b) {
+		fds[b] = finddups_new();
+		if (finddups_set_backend(fds[b], backends[b])) {
+			fprintf(stderr, "cmpbench: %s unavailable, skipping it\n", backends[b]);
+			finddups_free(fds[b]);
+			fds[b] = NULL;
+		}
+	}
+	snprintf(pa, sizeof pa, "%s/cmpbench.%d.a", dir, (int) getpid());
+	snprintf(pb, sizeof pb, "%s/cmpbench.%d.b", dir, (int) getpid());
+
+	printf("backend,kernel,bufsize,filesize,mismatch_at,seconds_per_compare,MiB_per_s\n");
+	for (si = 0; si < nsizes; ++si) {
+		size = sizes[si];
+		if (!(data = malloc(size + 1)))
+			exit(2);
+		for (at = 0; at < size; ++at)
+			data[at] = rand();
+		writeFile(pa, data, size);
+		for (mi = 0; mi < nmism; ++mi) {
+			/* flip one byte of the second file at the mismatch point */
+			at = mism[mi] >= 1 ? size : mism[mi] * size;
+			if (at < size)
+				data[at] ^= 0x55;
+			writeFile(pb, data, size);
+			if (at < size)
+				data[at] ^= 0x55;
+			for (bi = 0; bi < nbuf; ++bi) {
+				bufsize = bufsizes[bi];
+				ba = malloc(bufsize);
+				bb = malloc(bufsize);
+				if (!ba || !bb)
+					exit(2);
+				for (b = 0; b < (int) (sizeof backends / sizeof backends[0]); ++b) {
+					if (!fds[b])
+						continue;
+					for (kk = 0; kk < sizeof kernels / sizeof kernels[0]; ++kk) {
+#if defined(__SSE2__)
+						if (kernels[kk].fn == kAVX2 && !__builtin_cpu_supports("avx2"))
+							continue;
+#endif
+						/* warm up, then repeat until minTime has passed */
+						compare(fds[b], &kernels[kk], pa, pb, size, bufsize, ba, bb);
+						bytes = 0;
+						start = now();
+						for (reps = 0; (elapsed = now() - start) < minTime; ++reps)
+							bytes += compare(fds[b], &kernels[kk], pa, pb, size, bufsize, ba, bb);
+						printf("%s,%s,%zu,%zu,%zu,%.9f,%.1f\n", backends[b], kernels[kk].name,
+								bufsize, size, at, elapsed / reps, bytes / 1048576.0 / elapsed);
+						fflush(stdout);
+					}
+				}
+				free(ba);
+				free(bb);
+			}
+		}
+		free(data);
+	}
+	unlink(pa);
+	unlink(pb);
+	for (b = 0; b < (int) (sizeof backends / sizeof backends[0]); ++b)
+		if (fds[b])
+			finddups_free(fds[b]);
+	return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# errcheck.sh - check that files becoming unreadable partway through a
+#               comparison neither split nor lose groups of duplicates.
+#
+# usage: bench/errcheck.sh [-w workdir] [-- finddups options]
+#
+# Builds finddups and slowfs, makes FILES identical files, then runs
+# finddups once for every file and every open of it, with slowfs failing
+# that open and all later ones. Each run must report exactly one group,
+# holding every file it did not report as unreadable (or none, when fewer
+# than two are left). Prints the failing cases and exits 1 if there are any.
+
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+work=${TMPDIR:-/tmp}/finddups-errcheck
+files=4
+
+while getopts w: opt; do
+	case $opt in
+	w) work=$OPTARG ;;
+	*) sed -n 5p "$0" >&2; exit 64 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+mkdir -p "$work"
+cc -O2 -pthread -o "$work/finddups" "$src/finddups.c" "$src/libfinddups.c"
+cc -O2 -shared -fPIC -o "$work/slowfs.so" "$src/bench/slowfs.c" -ldl -pthread
+
+rm -rf "$work/tree"
+mkdir "$work/tree"
+head -c 200000 /dev/urandom > "$work/tree/f0"
+i=1
+while [ $i -lt $files ]; do
+	cp "$work/tree/f0" "$work/tree/f$i"
+	i=$((i + 1))
+done
+
+bad=0
+f=0
+while [ $f -lt $files ]; do
+	n=0
+	while [ $n -lt $files ]; do
+		# pairwise compares, so that each open is one of a row
+		SLOWFS_FAIL="tree/f$f:$n" LD_PRELOAD="$work/slowfs.so" \
+			"$work/finddups" --small-budget=0 "$@" "$work/tree" \
+			> "$work/out" 2> "$work/err" || true
+		sed -n 's,^  .*/\(f[0-9]*\): .*,\1,p' "$work/err" > "$work/failed"
+		expect=$(ls "$work/tree" | grep -vxF -f "$work/failed" | sort | tr '\n' ' ')
+		[ "$(echo "$expect" | wc -w)" -ge 2 ] || expect=
+		got=$(sed -n 's,^.*/\(f[0-9]*\)$,\1,p' "$work/out" | sort | tr '\n' ' ')
+		groups=$(grep -c '^duplicates of size' "$work/out" || true)
+		if [ "$got" != "$expect" ] || [ "$groups" -gt 1 ]; then
+			echo "f$f failing from open $((n + 1)): got $groups group(s): $got; expected: $expect"
+			bad=1
+		fi
+		n=$((n + 1))
+	done
+	f=$((f + 1))
+done
+[ $bad = 0 ] && echo "ok"
+exit $bad
@@ -0,0 +1,229 @@
+/* gentree - build a reproducible synthetic directory tree for benchmarking
+ *           finddups
+ *
+ * Copyright 2012, Alex Stangl
+ * License: OpenBSD/ISC.  See file LICENSE for full text of license.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EX_USAGE 64
+
+/* default size histogram: upper bound of each size class, and its weight */
+#define DEFAULT_SIZES "4096:40,65536:30,1048576:20,16777216:10"
+
+#define MAXCLASSES 32
+
+/* everything needed to regenerate a file's contents */
+struct spec {unsigned long long seed, size, divergeAt, divergeSeed; int sparse; char path[64];};
+
+static struct spec *files;
+static long nfiles;
+static unsigned long long rng = 88172645463325252ULL;
+static char *root;
+
+static unsigned long long sizeMax[MAXCLASSES];
+static double sizeWeight[MAXCLASSES];
+static int nclasses;
+
+static void error_exit(const char *msg, const char *parm)
+{
+	fprintf(stderr, "gentree: %s%s: %s\n", msg, parm ? parm : "", strerror(errno));
+	exit(1);
+}
+
+/* xorshift64* */
+static unsigned long long next(unsigned long long *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return *s * 2685821657736338717ULL;
+}
+
+static double uniform(void)
+{
+	return (next(&rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void parseSizes(const char *spec)
+{
+	char *end;
+	for (nclasses = 0; *spec && nclasses < MAXCLASSES; ++nclasses) {
+		sizeMax[nclasses] = strtoull(spec, &end, 0);
+		if (*end != ':')
+			break;
+		sizeWeight[nclasses] = strtod(end + 1, &end);
+		spec = *end == ',' ? end + 1 : end;
+	}
+	if (*spec || !nclasses) {
+		fprintf(stderr, "gentree: bad size histogram\n");
+		exit(EX_USAGE);
+	}
+}
+
+/* pick size class by weight, then a size uniformly within that class */
+static unsigned long long pickSize(void)
+{
+	double total = 0, r;
+	unsigned long long lo;
+	int c;
+	for (c = 0; c < nclasses; ++c)
+		total += sizeWeight[c];
+	r = uniform() * total;
+	for (c = 0; c < nclasses - 1 && r >= sizeWeight[c]; ++c)
+		r -= sizeWeight[c];
+	lo = c ? sizeMax[c - 1] + 1 : 1;
+	return lo + next(&rng) % (sizeMax[c] - lo + 1);
+}
+
+/* create parent directories of path, which is relative to root */
+static void makeDirs(char *path)
+{
+	char *p;
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST)
+			error_exit("Error creating ", path);
+		*p = '/';
+	}
+}
+
+/* write contents described by sp. Sparse files get data only in their first
+ * 4 KiB and in the chunks holding their last byte or the divergence point;
+ * the rest is a hole.
+ */
+static void writeFile(const struct spec *sp, const char *path)
+{
+	int sparse = sp->sparse;
+	static unsigned long long buf[8192];
+	unsigned long long s = sp->seed, d = sp->divergeSeed, off, n, k;
+	int fd;
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		error_exit("Error creating ", path);
+	for (off = 0; off < sp->size; off += n) {
+		n = sp->size - off < sizeof buf ? sp->size - off : sizeof buf;
+		for (k = 0; k < (n + 7) / 8; ++k)
+			buf[k] = sparse ? 0 : next(&s);
+		if (sp->divergeAt >= off && sp->divergeAt < off + n)
+			((unsigned char *) buf)[sp->divergeAt - off] ^= 1 + next(&d) % 255;
+		if (sparse && off && off + n < sp->size
+				&& !(sp->divergeAt >= off && sp->divergeAt < off + n))
+			continue;
+		if (sparse && !off)
+			memset(buf, 0x5a, n < 4096 ? n : 4096);
+		if (pwrite(fd, buf, n, off) != (ssize_t) n)
+			error_exit("Error writing ", path);
+	}
+	if (ftruncate(fd, sp->size))
+		error_exit("Error sizing ", path);
+	close(fd);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: gentree [-n files] [-s size:weight,...] [-d dupratio] [-m nearratio]\n"
+			"               [-o head|middle|tail] [-l linkratio] [-p sparseratio]\n"
+			"               [-f fanout] [-r seed] dir\n");
+	exit(EX_USAGE);
+}
+
+int main(int argc, char **argv)
+{
+	long n = 10000, i, src, ndup = 0, nnear = 0, nlink = 0, nsparse = 0;
+	double dupRatio = 0.2, nearRatio = 0.2, linkRatio = 0.02, sparseRatio = 0;
+	unsigned long long total = 0;
+	int fanout = 32, c, where = 1;
+	char path[4096], target[4096];
+	struct spec *sp;
+
+	parseSizes(DEFAULT_SIZES);
+	while ((c = getopt(argc, argv, "n:s:d:m:o:l:p:f:r:")) != -1) {
+		switch (c) {
+		case 'n': n = atol(optarg); break;
+		case 's': parseSizes(optarg); break;
+		case 'd': dupRatio = atof(optarg); break;
+		case 'm': nearRatio = atof(optarg); break;
+		case 'o':
+			if (!strcmp(optarg, "head"))
+				where = 0;
+			else if (!strcmp(optarg, "middle"))
+				where = 1;
+			else if (!strcmp(optarg, "tail"))
+				where = 2;
+			else
+				usage();
+			break;
+		case 'l': linkRatio = atof(optarg); break;
+		case 'p': sparseRatio = atof(optarg); break;
+		case 'f': fanout = atoi(optarg); break;
+		case 'r': rng = strtoull(optarg, NULL, 0) * 2654435761ULL + 1; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1 || n < 1 || fanout < 1)
+		usage();
+	root = argv[optind];
+	if (mkdir(root, 0755) && errno != EEXIST)
+		error_exit("Error creating ", root);
+
+	files = malloc(n * sizeof (struct spec));
+	if (!files)
+		exit(2);
+	for (i = 0; i < n; ++i) {
+		sp = &files[nfiles];
+		snprintf(sp->path, sizeof sp->path, "d%02d/d%02d/f%ld",
+				(int) (next(&rng) % fanout), (int) (next(&rng) % fanout), i);
+		snprintf(path, sizeof path, "%s/%s", root, sp->path);
+		makeDirs(path);
+		src = nfiles ? (long) (next(&rng) % nfiles) : -1;
+
+		/* hard link to an earlier file: same inode, nothing new to describe */
+		if (src >= 0 && uniform() < linkRatio) {
+			snprintf(target, sizeof target, "%s/%s", root, files[src].path);
+			unlink(path);
+			if (link(target, path))
+				error_exit("Error linking ", path);
+			++nlink;
+			continue;
+		}
+
+		if (src >= 0 && uniform() < dupRatio) {
+			*sp = files[src];
+			snprintf(sp->path, sizeof sp->path, "d%02d/d%02d/f%ld",
+					(int) (next(&rng) % fanout), (int) (next(&rng) % fanout), i);
+			snprintf(path, sizeof path, "%s/%s", root, sp->path);
+			makeDirs(path);
+			++ndup;
+		} else if (src >= 0 && uniform() < nearRatio) {
+			/* same size and contents as src up to the divergence point */
+			sp->seed = files[src].seed;
+			sp->size = files[src].size;
+			sp->divergeAt = where == 0 ? sp->size / 64 : where == 1 ? sp->size / 2 : sp->size - 1 - sp->size / 64;
+			sp->divergeSeed = next(&rng) | 1;
+			sp->sparse = files[src].sparse;
+			++nnear;
+		} else {
+			sp->seed = next(&rng) | 1;
+			sp->size = pickSize();
+			sp->divergeAt = ~0ULL;
+			sp->divergeSeed = 1;
+			sp->sparse = uniform() < sparseRatio;
+		}
+		nsparse += sp->sparse;
+		writeFile(sp, path);
+		total += sp->size;
+		++nfiles;
+	}
+	printf("%ld files (%ld duplicates, %ld near-duplicates, %ld hard links, %ld sparse), %llu bytes\n",
+			n, ndup, nnear, nlink, nsparse, total);
+	return 0;
+}
@@ -0,0 +1,96 @@
+#!/bin/sh
+# run.sh - end-to-end benchmark of finddups over synthetic trees built by
+#          gentree. Each dataset is run once with a cold page cache (when
+#          caches can be dropped, i.e. as root) and RUNS times warm.
+#
+# usage: bench/run.sh [-w workdir] [-k runs] [-d dataset[,dataset...]] [finddups options]
+#
+# Datasets are generated once per workdir and reused while their gentree
+# arguments stay the same. Output is one line per run:
+#   dataset cache wall_s scan_s compare_s files/s read_MiB/s peak_RSS_MiB
+# wall_s is the whole finddups process, start to exit; files/s is over it,
+# and read_MiB/s over the compare phase.
+
+set -e
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+work=${TMPDIR:-/tmp}/finddups-bench
+runs=3
+only=
+
+while getopts w:k:d: opt; do
+	case $opt in
+	w) work=$OPTARG ;;
+	k) runs=$OPTARG ;;
+	d) only=$OPTARG ;;
+	*) sed -n 6p "$0" >&2; exit 64 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+# name and gentree arguments of each dataset
+datasets='
+smallfiles	-n 50000 -s 1024:60,16384:30,65536:10 -d 0.3 -m 0.2
+mixed	-n 10000 -d 0.2 -m 0.2 -l 0.02
+headdiff	-n 2000 -s 4194304:1 -d 0.1 -m 0.6 -o head
+taildiff	-n 2000 -s 4194304:1 -d 0.1 -m 0.6 -o tail
+sparse	-n 500 -s 67108864:1 -d 0.3 -m 0.3 -p 0.8
+'
+
+mkdir -p "$work"
+cc -O2 -pthread -o "$work/finddups" "$src/finddups.c" "$src/libfinddups.c"
+cc -O2 -o "$work/gentree" "$src/bench/gentree.c"
+
+dropCaches() {
+	sync
+	echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+}
+
+# wall-clock time, for timing each finddups process as a whole
+now() {
+	date +%s.%N
+}
+
+# extract a numeric field from finddups --stats=json output
+field() {
+	sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p" "$work/stats"
+}
+
+# report dataset cache start end: one line for the run between start and end
+report() {
+	awk -v name="$1" -v cache="$2" -v start="$3" -v end="$4" \
+		-v scan="$(field scan_wall_seconds)" -v cmp="$(field compare_wall_seconds)" \
+		-v files="$(field files_scanned)" -v bytes="$(field bytes_read)" \
+		-v rss="$(field peak_rss_bytes)" 'BEGIN {
+		wall = end - start
+		if (wall <= 0) wall = 1e-6
+		printf "%-12s %-5s %8.3f %8.3f %9.3f %10.0f %10.1f %8.1f\n", name, cache, wall,
+			scan, cmp, files / wall, bytes / 1048576 / (cmp > 0 ? cmp : 1e-6), rss / 1048576
+	}'
+}
+
+printf "%-12s %-5s %8s %8s %9s %10s %10s %8s\n" dataset cache wall_s scan_s compare_s \
+	files/s read_MiB/s rss_MiB
+echo "$datasets" | while IFS='	' read -r name args; do
+	[ -n "$name" ] || continue
+	case ",$only," in ,,|*",$name,"*) ;; *) continue ;; esac
+	dir=$work/$name
+	if [ "$(cat "$dir.args" 2>/dev/null)" != "$args" ]; then
+		rm -rf "$dir"
+		# shellcheck disable=SC2086
+		"$work/gentree" $args "$dir" >&2
+		echo "$args" > "$dir.args"
+	fi
+	if dropCaches; then
+		start=$(now)
+		"$work/finddups" --stats=json "$@" "$dir" > /dev/null 2> "$work/stats"
+		report "$name" cold "$start" "$(now)"
+	fi
+	i=0
+	while [ $i -lt "$runs" ]; do
+		start=$(now)
+		"$work/finddups" --stats=json "$@" "$dir" > /dev/null 2> "$work/stats"
+		report "$name" warm "$start" "$(now)"
+		i=$((i + 1))
+	done
+done
@@ -0,0 +1,358 @@
+/* slowfs - LD_PRELOAD shim that makes local files behave like a slow network
+ *          or FUSE filesystem, for benchmarking finddups on a dev box.
+ *
+ * Copyright 2012, Alex Stangl
+ * License: OpenBSD/ISC.  See file LICENSE for full text of license.
+ *
+ * Build:  cc -O2 -shared -fPIC -o slowfs.so bench/slowfs.c -ldl -pthread
+ * Use:    SLOWFS_LATENCY_US=500 SLOWFS_BANDWIDTH=50000000 \
+ *             LD_PRELOAD=./slowfs.so finddups /some/dir
+ *
+ * Environment:
+ *   SLOWFS_LATENCY_US       delay added to each open, stat and directory read
+ *   SLOWFS_READ_LATENCY_US  delay added to each read (default: as above)
+ *   SLOWFS_BANDWIDTH        cap on read bytes/second, shared by all threads
+ *   SLOWFS_PREFIX           only slow down paths under this prefix
+ *   SLOWFS_FAIL=SUBSTR:N    let opens of paths containing SUBSTR succeed N
+ *                           times, then fail them with EIO, to test how a
+ *                           run copes with files that become unreadable
+ *
+ * nftw reads directories and stats entries inside libc, where calls cannot
+ * be interposed, so nftw itself is wrapped: each entry it reports costs one
+ * stat, and each directory one more call for reading its entries.
+ *
+ * Only reads through read and pread are slowed down. The mmap backend
+ * reads by page faults and the io_uring one in the kernel, so both bypass
+ * the shim for file contents; their opens, stats and directory reads are
+ * still slowed and can still be failed.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAXFD 65536
+
+static long latency = -1, readLatency, bandwidth;
+static const char *prefix;
+static size_t prefixLen;
+static char *failPath;
+static long failAfter;
+static unsigned char slowFd[MAXFD];
+static pthread_mutex_t bwLock = PTHREAD_MUTEX_INITIALIZER;
+static double bwNextFree;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init(void)
+{
+	const char *s;
+	latency = (s = getenv("SLOWFS_LATENCY_US")) ? atol(s) : 0;
+	readLatency = (s = getenv("SLOWFS_READ_LATENCY_US")) ? atol(s) : latency;
+	bandwidth = (s = getenv("SLOWFS_BANDWIDTH")) ? atol(s) : 0;
+	if ((prefix = getenv("SLOWFS_PREFIX")) != NULL)
+		prefixLen = strlen(prefix);
+	if ((s = getenv("SLOWFS_FAIL")) != NULL && (s = strrchr(failPath = strdup(s), ':')) != NULL) {
+		failPath[s - failPath] = '\0';
+		failAfter = atol(s + 1);
+	} else {
+		failPath = NULL;
+	}
+}
+
+static void *real(const char *name)
+{
+	void *fn = dlsym(RTLD_NEXT, name);
+	if (!fn)
+		abort();
+	return fn;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleepFor(double secs)
+{
+	struct timespec ts;
+	if (secs <= 0)
+		return;
+	ts.tv_sec = secs;
+	ts.tv_nsec = (secs - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts));
+}
+
+static int slowPath(const char *path)
+{
+	pthread_once(&once, init);
+	return !prefix || (path && !strncmp(path, prefix, prefixLen));
+}
+
+static void delay(long us)
+{
+	sleepFor(us / 1e6);
+}
+
+/* model a shared link: each read waits its turn, then for its own bytes */
+static void throttle(ssize_t bytes)
+{
+	double t, done;
+	if (bandwidth <= 0 || bytes <= 0)
+		return;
+	pthread_mutex_lock(&bwLock);
+	t = now();
+	done = (bwNextFree > t ? bwNextFree : t) + (double) bytes / bandwidth;
+	bwNextFree = done;
+	pthread_mutex_unlock(&bwLock);
+	sleepFor(done - t);
+}
+
+/* whether this open of path is one SLOWFS_FAIL asks to fail */
+static int failOpen(const char *path)
+{
+	pthread_once(&once, init);
+	if (!failPath || !path || !strstr(path, failPath)
+			|| __atomic_fetch_sub(&failAfter, 1, __ATOMIC_RELAXED) > 0)
+		return 0;
+	errno = EIO;
+	return 1;
+}
+
+static int track(int fd, const char *path)
+{
+	if (fd >= 0 && fd < MAXFD)
+		slowFd[fd] = slowPath(path);
+	return fd;
+}
+
+static int slow(int fd)
+{
+	return fd >= 0 && fd < MAXFD && slowFd[fd];
+}
+
+/* open and friends take an optional mode argument */
+#define GETMODE(flags, mode) do { \
+	va_list ap; \
+	mode = 0; \
+	if ((flags) & (O_CREAT | O_TMPFILE)) { \
+		va_start(ap, flags); \
+		mode = va_arg(ap, int); \
+		va_end(ap); \
+	} \
+} while (0)
+
+int open(const char *path, int flags, ...)
+{
+	static int (*fn)(const char *, int, ...);
+	int mode;
+	GETMODE(flags, mode);
+	if (!fn)
+		fn = real("open");
+	if (slowPath(path))
+		delay(latency);
+	if (failOpen(path))
+		return -1;
+	return track(fn(path, flags, mode), path);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	static int (*fn)(const char *, int, ...);
+	int mode;
+	GETMODE(flags, mode);
+	if (!fn)
+		fn = real("open64");
+	if (slowPath(path))
+		delay(latency);
+	if (failOpen(path))
+		return -1;
+	return track(fn(path, flags, mode), path);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	static int (*fn)(int, const char *, int, ...);
+	int mode;
+	GETMODE(flags, mode);
+	if (!fn)
+		fn = real("openat");
+	if (slowPath(path))
+		delay(latency);
+	if (failOpen(path))
+		return -1;
+	return track(fn(dirfd, path, flags, mode), path);
+}
+
+int close(int fd)
+{
+	static int (*fn)(int);
+	if (!fn)
+		fn = real("close");
+	if (fd >= 0 && fd < MAXFD)
+		slowFd[fd] = 0;
+	return fn(fd);
+}
+
+ssize_t read(int fd, void *buf, size_t n)
+{
+	static ssize_t (*fn)(int, void *, size_t);
+	ssize_t nr;
+	if (!fn)
+		fn = real("read");
+	if (!slow(fd))
+		return fn(fd, buf, n);
+	delay(readLatency);
+	nr = fn(fd, buf, n);
+	throttle(nr);
+	return nr;
+}
+
+ssize_t pread(int fd, void *buf, size_t n, off_t off)
+{
+	static ssize_t (*fn)(int, void *, size_t, off_t);
+	ssize_t nr;
+	if (!fn)
+		fn = real("pread");
+	if (!slow(fd))
+		return fn(fd, buf, n, off);
+	delay(readLatency);
+	nr = fn(fd, buf, n, off);
+	throttle(nr);
+	return nr;
+}
+
+ssize_t pread64(int fd, void *buf, size_t n, off_t off)
+{
+	static ssize_t (*fn)(int, void *, size_t, off_t);
+	ssize_t nr;
+	if (!fn)
+		fn = real("pread64");
+	if (!slow(fd))
+		return fn(fd, buf, n, off);
+	delay(readLatency);
+	nr = fn(fd, buf, n, off);
+	throttle(nr);
+	return nr;
+}
+
+int stat(const char *path, struct stat *st)
+{
+	static int (*fn)(const char *, struct stat *);
+	if (!fn)
+		fn = real("stat");
+	if (slowPath(path))
+		delay(latency);
+	return fn(path, st);
+}
+
+int lstat(const char *path, struct stat *st)
+{
+	static int (*fn)(const char *, struct stat *);
+	if (!fn)
+		fn = real("lstat");
+	if (slowPath(path))
+		delay(latency);
+	return fn(path, st);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+	static int (*fn)(int, const char *, struct stat *, int);
+	if (!fn)
+		fn = real("fstatat");
+	if (slowPath(path))
+		delay(latency);
+	return fn(dirfd, path, st, flags);
+}
+
+/* opendir and closedir open and close the descriptor inside libc, past the
+ * wrappers above, so the one under each DIR is tracked here
+ */
+DIR *opendir(const char *path)
+{
+	static DIR *(*fn)(const char *);
+	DIR *d;
+	if (!fn)
+		fn = real("opendir");
+	if (slowPath(path))
+		delay(latency);
+	if ((d = fn(path)) != NULL)
+		track(dirfd(d), path);
+	return d;
+}
+
+/* fd was opened through the wrappers, so it is tracked already */
+DIR *fdopendir(int fd)
+{
+	static DIR *(*fn)(int);
+	if (!fn)
+		fn = real("fdopendir");
+	return fn(fd);
+}
+
+int closedir(DIR *d)
+{
+	static int (*fn)(DIR *);
+	int fd = dirfd(d);
+	if (!fn)
+		fn = real("closedir");
+	if (fd >= 0 && fd < MAXFD)
+		slowFd[fd] = 0;
+	return fn(d);
+}
+
+struct dirent *readdir(DIR *d)
+{
+	static struct dirent *(*fn)(DIR *);
+	if (!fn)
+		fn = real("readdir");
+	if (slow(dirfd(d)))
+		delay(latency);
+	return fn(d);
+}
+
+/* nftw wrapper: pass each entry through after charging for its stat */
+typedef int (*nftwFn)(const char *, const struct stat *, int, struct FTW *);
+static __thread nftwFn userFn;
+
+static int slowVisit(const char *name, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if (slowPath(name))
+		delay(flag == FTW_D ? 2 * latency : latency);
+	return userFn(name, st, flag, ftw);
+}
+
+static int wrapNftw(const char *sym, const char *dir, nftwFn fn, int fds, int flags)
+{
+	int (*nftwReal)(const char *, nftwFn, int, int) = real(sym);
+	nftwFn saved = userFn;
+	int r;
+	userFn = fn;
+	r = nftwReal(dir, slowVisit, fds, flags);
+	userFn = saved;
+	return r;
+}
+
+int nftw(const char *dir, nftwFn fn, int fds, int flags)
+{
+	return wrapNftw("nftw", dir, fn, fds, flags);
+}
+
+/* struct stat64 has the same layout as struct stat on 64-bit systems */
+int nftw64(const char *dir, __nftw64_func_t fn, int fds, int flags)
+{
+	return wrapNftw("nftw64", dir, (nftwFn) fn, fds, flags);
+}
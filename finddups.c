@@ -3,405 +3,1172 @@
  *
  * Copyright 2012, Alex Stangl
  * License: OpenBSD/ISC.  See file LICENSE for full text of license.
+ *
+ * Command-line client of libfinddups: formats the groups it reports, and
+ * adds progress, stats and metrics output.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <syslog.h>
-#include <sys/stat.h>
+#include <time.h>
+#include <linux/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libfinddups.h"
 
 /*@-exitarg@*/
 
-/* buffer size default value; override when compiling with -DBUFSIZE=... */
-#if !defined(BUFSIZE)
-#define BUFSIZE 1024
-#endif
+#define EX_USAGE 64
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
 
-/* change DEBUG to 1 on next line to enable debug printing */
-#define DEBUG 0
+static double wallNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-#if DEBUG
-#define DEBUG_PRINT(...) printf(__VA_ARGS__)
-#else
-#define DEBUG_PRINT(...)
+/* index of the named counter of finddups_stat */
+static int statIndex(const char *name)
+{
+	const char *s;
+	int k;
+	for (k = 0; (s = finddups_stat_name(k)) != NULL; ++k)
+		if (!strcmp(s, name))
+			return k;
+	return -1;
+}
+
+/* Output sink. Groups are written to a large buffer as soon as their bucket
+ * is resolved, and the buffer goes out when full, or when a group arrives
+ * more than a second after the last write, so results show up promptly.
+ */
+#if !defined(OUTBUFSIZE)
+#define OUTBUFSIZE (1024 * 1024)
 #endif
 
-#define EX_USAGE 64
+static struct {int fd; char *buf; size_t len; time_t last;} sink = {1, NULL, 0, 0};
+static pthread_mutex_t sinkLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void writeAll(int fd, const char *p, size_t n)
+{
+	ssize_t nw;
+	for (; n; n -= nw, p += nw)
+		if ((nw = write(fd, p, n)) < 0)
+			die("Error writing output");
+}
+
+static void sinkFlush(void)
+{
+	writeAll(sink.fd, sink.buf, sink.len);
+	sink.len = 0;
+	sink.last = time(NULL);
+}
+
+static void sinkWrite(const char *p, size_t n)
+{
+	if (!sink.buf && !(sink.buf = malloc(OUTBUFSIZE)))
+		exit(2);
+	if (sink.len + n > OUTBUFSIZE)
+		sinkFlush();
+	if (n > OUTBUFSIZE) {
+		writeAll(sink.fd, p, n);
+		return;
+	}
+	memcpy(sink.buf + sink.len, p, n);
+	sink.len += n;
+}
+
+/* output formats: the original text listing, JSON Lines, NUL-delimited
+ * fields, and little-endian binary records; see README for layouts
+ */
+enum {FMT_TEXT, FMT_JSONL, FMT_NUL, FMT_BINARY} format = FMT_TEXT;
 
-struct fe {const char *name; struct fe *next; dev_t dev; ino_t inode;};
-struct dupNode {long size; struct fe *files; struct dupNode *next;};
-struct Node {long size,c; struct fe *files; struct Node *left, *right;int color;} *root;
+#define BINARY_MAGIC "FINDDUP1"
+
+static void sinkStr(const char *p)
+{
+	sinkWrite(p, strlen(p));
+}
+
+/* write a number; fmt must hold one conversion and little other text */
+static void sinkNum(const char *fmt, unsigned long long v)
+{
+	char num[48];
+	int n = snprintf(num, sizeof num, fmt, v);
+	assert(n >= 0 && n < (int) sizeof num);
+	sinkWrite(num, n);
+}
 
-void error_exit(char *errorMsg, const char *parm)
+static void sinkLE(unsigned long long v, int bytes)
 {
-	char *msg = errorMsg;
-	if (parm) {
-		msg = malloc(strlen(errorMsg) + strlen(parm) + 1);
-		strcpy(msg, errorMsg);
-		strcat(msg, parm);
+	char le[8];
+	int k;
+	for (k = 0; k < bytes; ++k, v >>= 8)
+		le[k] = v & 0xff;
+	sinkWrite(le, bytes);
+}
+
+/* write one group of n duplicate files of given size; the library's group
+ * callback
+ */
+static void emitGroup(void *arg, long size, const struct finddups_file *files, int n)
+{
+	unsigned long long reclaim = (unsigned long long) size * (n - 1);
+	int k;
+	pthread_mutex_lock(&sinkLock);
+	switch (format) {
+	case FMT_TEXT:
+		sinkNum("duplicates of size %llu\n", size);
+		for (k = 0; k < n; ++k) {
+			sinkStr(files[k].path);
+			sinkWrite("\n", 1);
+		}
+		break;
+	case FMT_JSONL:
+		sinkNum("{\"size\":%llu", size);
+		sinkNum(",\"reclaimable\":%llu", reclaim);
+		sinkStr(",\"files\":[");
+		for (k = 0; k < n; ++k) {
+			sinkStr(k ? ",{\"path\":" : "{\"path\":");
+			finddups_json(sinkWrite, files[k].path);
+			sinkNum(",\"dev\":%llu", files[k].dev);
+			sinkNum(",\"ino\":%llu}", files[k].ino);
+		}
+		sinkStr("]}\n");
+		break;
+	case FMT_NUL:
+		sinkNum("%llu", size);
+		sinkWrite("", 1);
+		sinkNum("%llu", reclaim);
+		sinkWrite("", 1);
+		for (k = 0; k < n; ++k) {
+			sinkNum("%llu:", files[k].dev);
+			sinkNum("%llu", files[k].ino);
+			sinkWrite("", 1);
+			sinkWrite(files[k].path, strlen(files[k].path) + 1);
+		}
+		sinkWrite("", 1);
+		break;
+	case FMT_BINARY:
+		sinkLE(size, 8);
+		sinkLE(reclaim, 8);
+		sinkLE(n, 4);
+		for (k = 0; k < n; ++k) {
+			sinkLE(files[k].dev, 8);
+			sinkLE(files[k].ino, 8);
+			sinkLE(strlen(files[k].path), 4);
+			sinkStr(files[k].path);
+		}
+		break;
 	}
+	if (time(NULL) > sink.last)
+		sinkFlush();
+	pthread_mutex_unlock(&sinkLock);
+}
 
-	syslog(LOG_USER, msg);
-	if (parm)
-		free(msg);
+/* Files that could not be read while comparing. The run leaves them out and
+ * carries on; the first few are listed at exit, with a count of the rest.
+ */
+#define UNREADABLE_LISTED 20
 
-	exit(1);
+static struct {char *path[UNREADABLE_LISTED]; int err[UNREADABLE_LISTED]; unsigned long n;} unreadable;
+static pthread_mutex_t unreadableLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void onUnreadable(void *arg, const char *path, int err)
+{
+	(void)arg;
+	pthread_mutex_lock(&unreadableLock);
+	if (unreadable.n < UNREADABLE_LISTED) {
+		if (!(unreadable.path[unreadable.n] = strdup(path)))
+			die("strdup");
+		unreadable.err[unreadable.n] = err;
+	}
+	++unreadable.n;
+	pthread_mutex_unlock(&unreadableLock);
+}
+
+static void reportUnreadable(void)
+{
+	unsigned long k;
+	if (!unreadable.n)
+		return;
+	fprintf(stderr, "finddups: %lu file%s could not be read and %s left out:\n", unreadable.n,
+			unreadable.n == 1 ? "" : "s", unreadable.n == 1 ? "was" : "were");
+	for (k = 0; k < unreadable.n && k < UNREADABLE_LISTED; ++k) {
+		fprintf(stderr, "  %s: %s\n", unreadable.path[k], strerror(unreadable.err[k]));
+		free(unreadable.path[k]);
+	}
+	if (unreadable.n > UNREADABLE_LISTED)
+		fprintf(stderr, "  ...and %lu more\n", unreadable.n - UNREADABLE_LISTED);
+}
+
+/* peak resident set size so far, in bytes */
+static unsigned long long peakRSS(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss * 1024ULL;
 }
 
-static void *Malloc(size_t bytes)
+/* run statistics, reported at exit with --stats */
+static void printStats(struct finddups *fd, FILE *f, int json)
 {
-	void *retval = malloc(bytes);
-	if (retval == 0)
+	const char *name;
+	double wall, cpu;
+	int k;
+	if (json) {
+		fputc('{', f);
+		for (k = 0; (name = finddups_stat_name(k)) != NULL; ++k)
+			fprintf(f, "%s\"%s\":%llu", k ? "," : "", name, finddups_stat(fd, k));
+		for (k = 0; (name = finddups_phase(fd, k, &wall, &cpu)) != NULL; ++k)
+			fprintf(f, ",\"%s_wall_seconds\":%.6f,\"%s_cpu_seconds\":%.6f",
+					name, wall, name, cpu);
+		fprintf(f, ",\"peak_rss_bytes\":%llu}\n", peakRSS());
+	} else {
+		for (k = 0; (name = finddups_stat_name(k)) != NULL; ++k)
+			fprintf(f, "%s %llu\n", name, finddups_stat(fd, k));
+		for (k = 0; (name = finddups_phase(fd, k, &wall, &cpu)) != NULL; ++k)
+			fprintf(f, "%s_wall_seconds %.3f\n%s_cpu_seconds %.3f\n",
+					name, wall, name, cpu);
+		fprintf(f, "peak_rss_bytes %llu\n", peakRSS());
+	}
+}
+
+/* Prometheus textfile-collector export (--metrics=FILE). The file is written
+ * at exit, and with --metrics-interval also every so many seconds while the
+ * run goes on. Each write goes to a temporary file renamed into place, so
+ * the collector never sees a partial one.
+ */
+static const char *metricsPath;
+static int metricsInterval;
+static double runStart;
+
+static void writeMetrics(struct finddups *fd, int running)
+{
+	const char *name;
+	double wall, cpu;
+	char *tmp;
+	FILE *f;
+	int k;
+	size_t len = strlen(metricsPath) + 32;
+
+	if (!(tmp = malloc(len)))
 		exit(2);
-	return retval;
+	snprintf(tmp, len, "%s.%ld.tmp", metricsPath, (long) getpid());
+	if (!(f = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return;
+	}
+	fprintf(f, "# TYPE finddups_running gauge\nfinddups_running %d\n", running);
+	fprintf(f, "# TYPE finddups_last_update_timestamp_seconds gauge\n"
+			"finddups_last_update_timestamp_seconds %ld\n", (long) time(NULL));
+	fprintf(f, "# TYPE finddups_duration_seconds gauge\nfinddups_duration_seconds %.3f\n",
+			wallNow() - runStart);
+	fprintf(f, "# TYPE finddups_phase_wall_seconds gauge\n");
+	for (k = 0; (name = finddups_phase(fd, k, &wall, &cpu)) != NULL; ++k)
+		fprintf(f, "finddups_phase_wall_seconds{phase=\"%s\"} %.3f\n", name, wall);
+	/* the --stats counters only ever grow */
+	for (k = 0; (name = finddups_stat_name(k)) != NULL; ++k)
+		fprintf(f, "# TYPE finddups_%s_total counter\nfinddups_%s_total %llu\n",
+				name, name, finddups_stat(fd, k));
+	fprintf(f, "# TYPE finddups_peak_rss_bytes gauge\nfinddups_peak_rss_bytes %llu\n", peakRSS());
+	if (fclose(f) || rename(tmp, metricsPath)) {
+		perror(metricsPath);
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+/* Progress reports (--progress[=FD]), written every PROGRESS_INTERVAL
+ * seconds by a thread of their own, which also does periodic metrics.
+ * The library's workers only bump relaxed atomic counters; rates and ETA
+ * are worked out here. Bytes left to compare is the content of unresolved
+ * buckets, which bounds from above what the pairwise path must read per file.
+ */
+#define PROGRESS_INTERVAL 1
+
+static struct {
+	int fd, tty, stop, comparing;
+	int files, read;                /* indexes of counters used */
+	double start;                   /* of the phase being reported */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} progress = {-1, 0, 0, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* format byte count n into buf in binary units */
+static const char *fmtBytes(char *buf, size_t len, double n)
+{
+	static const char units[] = "KMGTPE";
+	int u;
+	if (n < 1024) {
+		snprintf(buf, len, "%.0f B", n);
+		return buf;
+	}
+	for (u = -1; n >= 1024 && u < 5; ++u)
+		n /= 1024;
+	snprintf(buf, len, "%.1f %ciB", n, units[u]);
+	return buf;
 }
 
-static char *copystr(const char *from)
+static void progressReport(struct finddups *fd, double last, unsigned long long lastRead)
 {
-	size_t l = strlen(from);
-	char *retval = Malloc((l+1) * sizeof(char));
-	strcpy(retval, from);
-	return retval;
+	struct finddups_progress p;
+	char line[256], left[16], total[16], rate[16];
+	double now = wallNow(), elapsed, done, eta;
+	unsigned long long files, bytesRead = finddups_stat(fd, progress.read);
+	long secs;
+	int n;
+
+	finddups_get_progress(fd, &p);
+	if (p.comparing && !progress.comparing) {
+		progress.comparing = 1;
+		progress.start = now;
+	}
+	elapsed = now - progress.start;
+	if (!progress.comparing) {
+		files = finddups_stat(fd, progress.files);
+		n = snprintf(line, sizeof line, "scan: %llu files, %.0f files/s",
+				files, files / (elapsed > 0 ? elapsed : 1));
+	} else {
+		done = elapsed > 0 ? p.bytesDone / elapsed : 0;
+		n = snprintf(line, sizeof line, "compare: %llu of %llu buckets left, %s of %s left, reading %s/s",
+				p.buckets - p.bucketsDone, p.buckets,
+				fmtBytes(left, sizeof left, p.bytes - p.bytesDone),
+				fmtBytes(total, sizeof total, p.bytes),
+				fmtBytes(rate, sizeof rate, (bytesRead - lastRead) / (now - last > 0 ? now - last : 1)));
+		if (done > 0 && n < (int) sizeof line) {
+			eta = (p.bytes - p.bytesDone) / done;
+			secs = eta;
+			n += snprintf(line + n, sizeof line - n, ", ETA %ld:%02ld:%02ld",
+					secs / 3600, secs / 60 % 60, secs % 60);
+		}
+	}
+	if (n >= (int) sizeof line)
+		n = sizeof line - 1;
+	if (progress.tty)
+		dprintf(progress.fd, "\r%.*s\033[K", n, line);
+	else
+		dprintf(progress.fd, "%.*s\n", n, line);
 }
 
-static int isRed(struct Node *n) {
-	return n != NULL && n->color;
+static void *progressWorker(void *arg)
+{
+	struct finddups *fd = arg;
+	struct timespec ts;
+	unsigned long long lastRead = 0;
+	double last = wallNow();
+	long ticks = 0;
+
+	pthread_mutex_lock(&progress.lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += PROGRESS_INTERVAL;
+	while (!progress.stop) {
+		if (pthread_cond_timedwait(&progress.cond, &progress.lock, &ts) != ETIMEDOUT)
+			continue;
+		if (progress.fd >= 0)
+			progressReport(fd, last, lastRead);
+		if (metricsInterval && ++ticks % metricsInterval == 0)
+			writeMetrics(fd, 1);
+		last = wallNow();
+		lastRead = finddups_stat(fd, progress.read);
+		ts.tv_sec += PROGRESS_INTERVAL;
+	}
+	pthread_mutex_unlock(&progress.lock);
+	return NULL;
 }
 
-static void colorFlip(struct Node *n) {
-	assert(n->color == 0);
-	assert(n->left->color == 1);
-	assert(n->right->color == 1);
-	n->color = 1;
-	n->left->color = n->right->color = 0;
+static void startProgress(struct finddups *fd)
+{
+	progress.tty = progress.fd >= 0 && isatty(progress.fd);
+	progress.files = statIndex("files_scanned");
+	progress.read = statIndex("bytes_read");
+	progress.start = wallNow();
+	if (pthread_create(&progress.thread, NULL, progressWorker, fd))
+		die("Error creating progress thread");
 }
 
-static struct Node *rotateLeft(struct Node *h) {
-	struct Node *x = h->right;
-	h->right = x->left;
-	x->left = h;
-	x->color = h->color;
-	h->color = 1;
-	return x;
+static void stopProgress(void)
+{
+	pthread_mutex_lock(&progress.lock);
+	progress.stop = 1;
+	pthread_cond_signal(&progress.cond);
+	pthread_mutex_unlock(&progress.lock);
+	pthread_join(progress.thread, NULL);
+	if (progress.fd >= 0 && progress.tty)
+		dprintf(progress.fd, "\r\033[K");
 }
 
-static struct Node *rotateRight(struct Node *h) {
-	struct Node *x = h->left;
-	h->left = x->right;
-	x->right = h;
-	x->color = h->color;
-	h->color = 1;
-	return x;
+/* Daemon mode (--serve=SOCKET): keep the index resident and answer queries
+ * over a Unix stream socket, one request per line:
+ *   LOOKUP-PATH path          indexed files identical to path
+ *   LOOKUP-DIGEST size hex    indexed files of size whose SHA-256 is hex
+ *   ADD path                  index a file
+ *   REMOVE path               drop a file from the index
+ * Each reply is "OK n" and then n paths, one per line, or "ERR reason".
+ * Clients are multiplexed with poll and their requests served one at a time.
+ */
+#define MAX_REQUEST 65536
+
+struct client {int fd; char *buf; size_t len;};
+struct reply {char *p; size_t len, max;};
+
+static volatile sig_atomic_t stopping;
+
+static void onSignal(int sig)
+{
+	stopping = 1;
 }
 
-static struct fe *newFileNode(const char *name, const struct stat *st)
+static void catchSignals(void)
 {
-	struct fe *retval = malloc(sizeof (struct fe));
-	retval->name = copystr(name);
-	retval->next = NULL;
-	retval->dev = st->st_dev;
-	retval->inode = st->st_ino;
-	return retval;
+	struct sigaction sa;
+	/* no SA_RESTART, so poll returns when asked to stop */
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = onSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static void replyAdd(struct reply *r, const char *p, size_t n)
+{
+	if (r->len + n > r->max) {
+		r->max = (r->len + n) * 2;
+		if (!(r->p = realloc(r->p, r->max)))
+			exit(2);
+	}
+	memcpy(r->p + r->len, p, n);
+	r->len += n;
 }
 
-static struct fe *copyFileNode(struct fe *old)
+static void replyPath(void *arg, const struct finddups_file *f)
 {
-	struct fe *retval = malloc(sizeof (struct fe));
-	retval->name = copystr(old->name);
-	retval->next = NULL;
-	retval->dev = old->dev;
-	retval->inode = old->inode;
-	return retval;
+	replyAdd(arg, f->path, strlen(f->path));
+	replyAdd(arg, "\n", 1);
 }
 
+static int hexDigest(const char *hex, unsigned char *out)
+{
+	unsigned v;
+	int k;
+	for (k = 0; k < FINDDUPS_DIGEST_LEN; ++k) {
+		if (sscanf(hex + 2 * k, "%2x", &v) != 1)
+			return -1;
+		out[k] = v;
+	}
+	return hex[2 * k] ? -1 : 0;
+}
 
-/* recursive insert called during traversal
- * can optimize later by putting *name and *st into globals
+/* carry out one request line, leaving the paths of the reply in body; returns
+ * their count, or -1 with *err set
  */
-static struct Node *insertR(struct Node *node, const char *name, const struct stat *st)
-{
-	struct fe *fp;
-	if (!node) {
-		node = malloc(sizeof (struct Node));
-		node->size = st->st_size;
-		node->c = 1;
-		node->left = node->right = NULL;
-		node->files = newFileNode(name, st);
-		node->color = 1;
-	} else if (st->st_size == node->size) {
-		/* traverse file list to see if we have same dev/inode as an existing file (e.g., hard link)
-		 * if so, just return existing node unmodified (no need to add this redundant file)
-		 */
-		for (fp = node->files; fp; fp=fp->next) {
-			if (fp->dev == st->st_dev && fp->inode == st->st_ino)
-				return node;
-		}
-		fp = newFileNode(name, st);
-		fp->next = node->files;
-		node->files = fp;
+static int request(struct finddups *fd, char *line, struct reply *body, const char **err)
+{
+	unsigned char digest[FINDDUPS_DIGEST_LEN];
+	char *arg = strchr(line, ' '), *end;
+	long size;
+	int n;
+
+	*err = "bad request";
+	if (!arg)
+		return -1;
+	*arg++ = '\0';
+	if (!strcmp(line, "LOOKUP-PATH")) {
+		n = finddups_lookup_path(fd, arg, replyPath, body);
+	} else if (!strcmp(line, "LOOKUP-DIGEST")) {
+		size = strtol(arg, &end, 10);
+		if (end == arg || *end != ' ' || size < 0 || hexDigest(end + 1, digest))
+			return -1;
+		n = finddups_lookup_digest(fd, size, digest, replyPath, body);
+	} else if (!strcmp(line, "ADD")) {
+		n = finddups_add_file(fd, arg, NULL);
+	} else if (!strcmp(line, "REMOVE")) {
+		n = finddups_remove_file(fd, arg);
 	} else {
-		if (isRed(node->left) && isRed(node->right))
-			colorFlip(node);
+		return -1;
+	}
+	if (n < 0)
+		*err = strerror(errno);
+	return n;
+}
+
+/* send all of p to client; returns -1 if it has gone away */
+static int sendAll(int fd, const char *p, size_t n)
+{
+	ssize_t nw;
+	for (; n; n -= nw, p += nw)
+		if ((nw = send(fd, p, n, MSG_NOSIGNAL)) < 0 && errno != EINTR)
+			return -1;
+		else if (nw < 0)
+			nw = 0;
+	return 0;
+}
 
-		if (st->st_size < node->size) {
-			node->left = insertR(node->left, name, st);
+/* answer every complete line client has sent; returns -1 to drop client */
+static int serveClient(struct finddups *fd, struct client *c)
+{
+	struct reply body = {NULL, 0, 0};
+	char head[64], *line, *nl;
+	const char *err;
+	size_t used;
+	int n, r = 0;
+
+	for (line = c->buf; r == 0 && (nl = memchr(line, '\n', c->buf + c->len - line)); line = nl + 1) {
+		*nl = '\0';
+		body.len = 0;
+		if ((n = request(fd, line, &body, &err)) < 0) {
+			snprintf(head, sizeof head, "ERR %s\n", err);
+			r = sendAll(c->fd, head, strlen(head));
 		} else {
-			node->right = insertR(node->right, name, st);
+			snprintf(head, sizeof head, "OK %d\n", n);
+			r = sendAll(c->fd, head, strlen(head));
+			if (!r)
+				r = sendAll(c->fd, body.p, body.len);
+		}
+	}
+	free(body.p);
+	used = line - c->buf;
+	memmove(c->buf, line, c->len - used);
+	c->len -= used;
+	return c->len < MAX_REQUEST ? r : -1;
+}
+
+static void serve(struct finddups *fd, const char *path)
+{
+	struct sockaddr_un addr;
+	struct pollfd *pfds = NULL;
+	struct client *clients = NULL;
+	ssize_t nr;
+	int lfd, n = 0, max = 0, k;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "finddups: socket path too long\n");
+		exit(EX_USAGE);
+	}
+	strcpy(addr.sun_path, path);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		die("socket");
+	unlink(path);
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof addr) || listen(lfd, 64))
+		die(path);
+
+	catchSignals();
+
+	/* slot 0 is the listening socket, slot k the client k-1 */
+	while (!stopping) {
+		if (n + 1 >= max) {
+			max = max ? max * 2 : 16;
+			pfds = realloc(pfds, max * sizeof (struct pollfd));
+			clients = realloc(clients, max * sizeof (struct client));
+			if (!pfds || !clients)
+				exit(2);
+		}
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for (k = 0; k < n; ++k) {
+			pfds[k+1].fd = clients[k].fd;
+			pfds[k+1].events = POLLIN;
+		}
+		if (poll(pfds, n + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll");
+		}
+		for (k = n - 1; k >= 0; --k) {
+			if (!pfds[k+1].revents)
+				continue;
+			nr = read(clients[k].fd, clients[k].buf + clients[k].len, MAX_REQUEST - clients[k].len);
+			if (nr > 0) {
+				clients[k].len += nr;
+				if (!serveClient(fd, &clients[k]))
+					continue;
+			} else if (nr < 0 && errno == EINTR) {
+				continue;
+			}
+			close(clients[k].fd);
+			free(clients[k].buf);
+			clients[k] = clients[--n];
+		}
+		if (pfds[0].revents && (k = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+			clients[n].fd = k;
+			clients[n].len = 0;
+			if (!(clients[n++].buf = malloc(MAX_REQUEST)))
+				exit(2);
 		}
+	}
+	for (k = 0; k < n; ++k) {
+		close(clients[k].fd);
+		free(clients[k].buf);
+	}
+	free(clients);
+	free(pfds);
+	close(lfd);
+	unlink(path);
+}
 
-		if (isRed(node->right) && !isRed(node->left))
-			node = rotateLeft(node);
+/* Watch mode (--watch): after the first run, keep the index current from
+ * filesystem events, and once they settle run again over the buckets they
+ * touched, reporting only groups that gained a file. Each event is settled
+ * by looking at what is at its path now, so merged or reordered events do
+ * no harm. fanotify reports whole filesystems by directory handle and name
+ * but needs CAP_SYS_ADMIN; otherwise inotify watches every directory. If the
+ * kernel drops events, the roots are walked again, which picks up new files
+ * but not changes to files already indexed.
+ */
+#define WATCH_SETTLE 1       /* seconds without events before running again */
+#define WATCH_MAX_DELAY 5    /* run at least this often while events go on */
+
+static struct {
+	int fd, fan;             /* fanotify or inotify descriptor, and which */
+	char **roots;            /* canonical paths of roots, reference ones first */
+	int nroots, nrefs;
+	int *mountFds;           /* fanotify: open root dirs, to resolve handles by */
+	char **wdPaths;          /* inotify: directory of each watch descriptor */
+	int maxWd;
+} watch;
 
-		if (isRed(node->left) && isRed(node->left->left))
-			node = rotateRight(node);
+/* innermost root holding path, or -1 */
+static int underRoot(const char *path)
+{
+	size_t len, best = 0;
+	int k, r = -1;
+	for (k = 0; k < watch.nroots; ++k) {
+		len = strlen(watch.roots[k]);
+		if (len >= best && !strncmp(path, watch.roots[k], len)
+				&& (path[len] == '/' || !path[len] || len == 1)) {
+			best = len;
+			r = k;
+		}
 	}
-	return node;
+	return r;
 }
 
-/* main entry point for insert, inserting at root */
-static void insert(const char *name, const struct stat *st) {
-	/*
-	DEBUG_PRINT("Inserting %s with size %ld\n", name, st->st_size);
-	*/
-	root = insertR(root, name, st);
-	root->color = 0;
+/* walk dir as part of root k, or again as root k when it is the root */
+static void addUnder(struct finddups *fd, int k, const char *dir)
+{
+	if (k < watch.nrefs)
+		finddups_add_ref_root(fd, dir);
+	else
+		finddups_add_root(fd, dir);
 }
 
-static int visit(const char *name, const struct stat *st, int flag, struct FTW *ftw) {
-	/*
-	DEBUG_PRINT("name = %s, flag = %d, st = %ld\n", name, flag, st);
-	DEBUG_PRINT("visiting %s with size %ld\n", name, st->st_size);
-	*/
-	if (flag == FTW_F) 
-		insert(name, st);
+#define INOTIFY_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE \
+		| IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static int inoVisit(const char *name, const struct stat *st, int flag, struct FTW *ftw)
+{
+	int wd;
+	if (flag != FTW_D || (wd = inotify_add_watch(watch.fd, name, INOTIFY_MASK)) < 0)
+		return 0;
+	if (wd >= watch.maxWd) {
+		watch.wdPaths = realloc(watch.wdPaths, (wd + 1) * 2 * sizeof (char *));
+		if (!watch.wdPaths)
+			exit(2);
+		memset(watch.wdPaths + watch.maxWd, 0, ((wd + 1) * 2 - watch.maxWd) * sizeof (char *));
+		watch.maxWd = (wd + 1) * 2;
+	}
+	free(watch.wdPaths[wd]);
+	if (!(watch.wdPaths[wd] = strdup(name)))
+		exit(2);
 	return 0;
 }
 
-static struct dupNode *addDupNode(int size, struct fe *file, struct dupNode *retval) {
-	struct fe *fp = copyFileNode(file);
-	if (!retval) {
-		retval = malloc(sizeof (struct dupNode));
-		retval->size = size;
-		retval->files = NULL;
-		retval->next = NULL;
+/* stop watching directories at or under dir, which has gone */
+static void inoForget(const char *dir)
+{
+	size_t len = strlen(dir);
+	int wd;
+	for (wd = 0; wd < watch.maxWd; ++wd) {
+		if (!watch.wdPaths[wd] || strncmp(watch.wdPaths[wd], dir, len)
+				|| (watch.wdPaths[wd][len] && watch.wdPaths[wd][len] != '/'))
+			continue;
+		inotify_rm_watch(watch.fd, wd);
+		free(watch.wdPaths[wd]);
+		watch.wdPaths[wd] = NULL;
 	}
-	fp->next = retval->files;
-	retval->files = fp;
-	return retval;
 }
 
-/* return possibly-null chain of duplicates, based on scanning files in
- * specified (sub)tree and possibly-null existing chain
- * should free all nodes, and file entries, except those returned
- */
-static struct dupNode *chkForDups(struct Node *node, struct dupNode *retval) {
-	int cnt, i, j, fdi, fdj, nri, nrj, *fflags, pr;
-	struct fe *fp, *fi, *fj;
-	struct dupNode *dn = 0, *pn = 0;
-	long *ar, ari, arj, maxToSkip;
-	char *ibuff, *jbuff;
-	off_t lsi, lsj;
-	if (node) {
-
-		/* do left subbranch, then process this node, then right subbranch
-		 * this way chain gets built up so that it starts with largest first
-		 */
-		retval = chkForDups(node->left, retval);
-
-		/* check for duplicates in this current node. First, degenerate cases:
-		 * If less than 2 files, then no dups
-		 * else if size == 0, all considered dups
-		 */
-		/* DEBUG_PRINT("Checking dups of size %ld\n", node->size); */
-		for (cnt=0, fp = node->files; fp != NULL; fp = fp->next, ++cnt);
-		if (cnt < 2) {
-			/* free all file entries */
-			for (fp = node->files; fp != NULL; fp = fp->next)
-				free(fp);
-		} else {
-			/* TODO If general case handles size == 0 case efficiently, get rid
-			 *     of this special case
-			 */
-			if (node->size) {
-				ibuff = Malloc(BUFSIZE);
-				jbuff = Malloc(BUFSIZE);
-				fflags = calloc(cnt, sizeof(int));
-				/* General case, two or more non-empty files.
-				 * allocate N x N array for bookkeeping to keep track of how
-				 * many blocks files A and B have in common
-				 */
-				ar = calloc(cnt * cnt, sizeof(long));
-				for (i = 0, fi = node->files; i < cnt - 1; ++i, fi = fi->next) {
-					/* DEBUG_PRINT("i = %d, file = %s, fflags[i] = %d\n", i, fi->name, fflags[i]); */
-					if (fflags[i])
-						continue;      /* i already output as a dup */
-
-					for (j = i + 1, fj = fi->next; fj; ++j, fj = fj->next) {
-						/* DEBUG_PRINT("j = %d, file = %s, fflags[j] = %d\n", j, fj->name, fflags[j]); */
-						if (fflags[j])
-							continue;  /* j already output as a dup */
-
-						/* Look in past rows of ar at column values for i & j.
-						 * If any rows have diff. values for these, we infer they don't match.
-						 * Otherwise, find max value for these in the prev. rows.
-						 * We know that these many blocks for the 2 files are identical, so
-						 * we can skip those.
-						 */
-						maxToSkip = 0;
-						/* DEBUG_PRINT("i = %d, cnt = %d\n", i, cnt); */
-						for (pr = 0; pr < i; ++pr) {
-							ari = ar[pr*cnt + i];
-							/* DEBUG_PRINT("ar[%d] = %ld, ar[%d] = %ld\n", pr*cnt + i, ari, pr*cnt + j, ar[pr*cnt + j]); */
-							if (ari != ar[pr*cnt + j]) {
-								DEBUG_PRINT("Skipping comparison of %s and %s because of prefix length diff\n",
-										fi->name, fj->name);
-								maxToSkip = -1;
-								break;
-							}
-							if (ari > maxToSkip)
-								maxToSkip = ari;
-						}
-
-						/* DEBUG_PRINT("maxToSkip = %ld\n", maxToSkip); */
-
-						if (maxToSkip < 0)
-							continue;         /* inferred these differ due to prefix length differences */
-
-						/* TODO  optimize open/closing of fi, maybe use a rewind */
-						if ((fdi = open(fi->name, O_RDONLY)) < 0) {
-							printf("Error opening %s\n", fi->name);
-							error_exit("Error opening ", fi->name);
-						}
-
-						/* error_exit("Error opening ", fi->name); */
-						if ((fdj = open(fj->name, O_RDONLY)) < 0)
-							error_exit("Error opening ", fj->name);
-
-						if (maxToSkip > 0) {
-							DEBUG_PRINT("Skipping ahead %ld in %s and %s because of prefix inferences\n",
-									maxToSkip, fi->name, fj->name);
-							lsi = lseek(fdi, maxToSkip, SEEK_SET);
-							lsj = lseek(fdj, maxToSkip, SEEK_SET);
-							if (lsi < 0 || lsj < 0) {
-								free(ibuff);
-								free(jbuff);
-								free(fflags);
-								free(ar);
-								close(fdj);
-								close(fdi);
-								error_exit("Error seeking in ",
-									lsi < 0 ? fi->name : fj->name);
-							}
-						}
-
-						for (;;) {
-							nri = read(fdi, ibuff, BUFSIZE);
-							nrj = read(fdj, jbuff, BUFSIZE);
-							if (nri < 0 || nrj < 0) {
-								free(ibuff);
-								free(jbuff);
-								free(fflags);
-								free(ar);
-								close(fdj);
-								close(fdi);
-								error_exit("Error reading ",
-									nri < 0 ? fi->name : fj->name);
-							}
-
-							/* check for files being diff, by length or by value */
-							if (nri != nrj)
-								break;
-
-							if (memcmp(ibuff, jbuff, nri))
-								break;
-
-							/* custom memcmp so we know where mismatch occurred */
-
-							/* note that we've successfully compared another block */
-							ar[i*cnt + j] += nri;
-							/* DEBUG_PRINT("ar[%d] = %ld\n", i*cnt + j, ar[i*cnt + j]); */
-
-							/* if we've reached end of file, these are dups */
-							if (!nri) {
-								/* DEBUG_PRINT("We found dups!\n"); */
-								/* make sure we only add fi once */
-								if (! fflags[i])
-									dn = addDupNode(node->size, fi, dn);
-								dn = addDupNode(node->size, fj, dn);
-								fflags[i] = fflags[j] = 1;
-								/* DEBUG_PRINT("setting fflags[%d] and fflags[%d]\n", i, j); */
-								break;
-							}
-						}
-						close(fdj);
-						close(fdi);
-					}
-
-					/* If we created a chain of dups of fi, then add this to the chain of dups & reset */
-					if (dn) {
-						dn->next = retval;
-						retval = dn;
-						dn = 0;
-					}
-				}
-				free(ibuff);
-				free(jbuff);
-				free(fflags);
-				free(ar);
-			} else {
-				/* size == 0, so we trivially consider them all dups */
-				dn = malloc(sizeof (struct dupNode));
-				dn->size = 0;
-				dn->files = node->files;
-				dn->next = retval;
-				retval = dn;
-			}
+/* bring index in line with whatever is now at path */
+static void watchPath(struct finddups *fd, const char *path)
+{
+	struct stat st;
+	int k;
+	if ((k = underRoot(path)) < 0)
+		return;
+	if (lstat(path, &st)) {
+		if (finddups_remove_file(fd, path))
+			finddups_remove_tree(fd, path);
+		if (!watch.fan)
+			inoForget(path);
+	} else if (S_ISDIR(st.st_mode)) {
+		/* already indexed files are recognized by dev/inode and skipped */
+		if (!watch.fan)
+			nftw(path, inoVisit, 64, FTW_PHYS);
+		addUnder(fd, k, path);
+	} else if (S_ISREG(st.st_mode)) {
+		finddups_remove_file(fd, path);
+		finddups_add_file(fd, path, &st);
+	}
+}
+
+static void rewalk(struct finddups *fd)
+{
+	int k;
+	for (k = 0; k < watch.nroots; ++k)
+		addUnder(fd, k, watch.roots[k]);
+}
+
+static int fanStart(void)
+{
+	int k;
+	watch.fd = syscall(__NR_fanotify_init, FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME, O_RDONLY);
+	if (watch.fd < 0)
+		return -1;
+	if (!(watch.mountFds = malloc(watch.nroots * sizeof (int))))
+		exit(2);
+	for (k = 0; k < watch.nroots; ++k) {
+		if (syscall(__NR_fanotify_mark, watch.fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				(unsigned long long) (FAN_CLOSE_WRITE | FAN_MOVED_FROM | FAN_MOVED_TO
+				| FAN_CREATE | FAN_DELETE | FAN_ONDIR), AT_FDCWD, watch.roots[k])
+				|| (watch.mountFds[k] = open(watch.roots[k], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+			while (k--)
+				close(watch.mountFds[k]);
+			free(watch.mountFds);
+			close(watch.fd);
+			return -1;
 		}
+	}
+	watch.fan = 1;
+	return 0;
+}
 
-		/* we can only have duplicates if this node has more than 1 file */
+static void inoStart(void)
+{
+	int k;
+	if ((watch.fd = inotify_init1(IN_CLOEXEC)) < 0)
+		die("inotify_init1");
+	for (k = 0; k < watch.nroots; ++k)
+		nftw(watch.roots[k], inoVisit, 64, FTW_PHYS);
+}
+
+/* path of directory in fanotify event, from its file handle */
+static int fanDir(struct file_handle *fh, char *path, size_t len)
+{
+	char proc[32];
+	ssize_t n = -1;
+	int k, dfd = -1;
+	for (k = 0; k < watch.nroots && dfd < 0; ++k)
+		dfd = open_by_handle_at(watch.mountFds[k], fh, O_PATH | O_CLOEXEC);
+	if (dfd < 0)
+		return -1;
+	snprintf(proc, sizeof proc, "/proc/self/fd/%d", dfd);
+	n = readlink(proc, path, len - 1);
+	close(dfd);
+	if (n < 0)
+		return -1;
+	path[n] = '\0';
+	return 0;
+}
 
-		/*
-		for (fp = node->files; fp; fp=fp->next)
-			DEBUG_PRINT("Checking for duplicate in file %s of size %ld\n", fp->name, node->size);
-		*/
-		retval = chkForDups(node->right, retval);
+/* handle events in buf; returns -1 if some were lost */
+static int fanEvents(struct finddups *fd, char *buf, ssize_t len)
+{
+	struct fanotify_event_metadata *m;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *fh;
+	char path[PATH_MAX], *name;
+	size_t dlen;
+	int lost = 0;
 
-		free(node);
+	for (m = (void *) buf; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len)) {
+		if (m->mask & FAN_Q_OVERFLOW) {
+			lost = 1;
+			continue;
+		}
+		/* a new file is dealt with once written */
+		if (m->mask == FAN_CREATE)
+			continue;
+		fid = (void *) ((char *) m + m->metadata_len);
+		if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+			continue;
+		fh = (struct file_handle *) fid->handle;
+		name = (char *) fh->f_handle + fh->handle_bytes;
+		if (fanDir(fh, path, sizeof path))
+			continue;
+		dlen = strlen(path);
+		if (strcmp(name, ".") && snprintf(path + dlen, sizeof path - dlen, "/%s", name) >= (int) (sizeof path - dlen))
+			continue;
+		watchPath(fd, path);
 	}
-	return retval;
+	return lost ? -1 : 0;
 }
 
-int main(int argc, char **argv)
+static int inoEvents(struct finddups *fd, char *buf, ssize_t len)
 {
-	int i, j;
-	struct dupNode *dups;
-	struct fe *fp;
+	struct inotify_event *e;
+	char path[PATH_MAX];
+	int lost = 0;
+	ssize_t off;
 
-	if (argc < 2) {
-		fprintf(stderr, "usage: finddups dir1 [dir2 ... [dirN]]\n");
-		exit(EX_USAGE);
+	for (off = 0; off < len; off += sizeof (struct inotify_event) + e->len) {
+		e = (struct inotify_event *) (buf + off);
+		if (e->mask & IN_Q_OVERFLOW) {
+			lost = 1;
+			continue;
+		}
+		if (e->mask & IN_IGNORED && e->wd < watch.maxWd) {
+			free(watch.wdPaths[e->wd]);
+			watch.wdPaths[e->wd] = NULL;
+		}
+		if (!e->len || e->wd >= watch.maxWd || !watch.wdPaths[e->wd])
+			continue;
+		if ((e->mask & (IN_CREATE | IN_ISDIR)) == IN_CREATE)
+			continue;
+		if (snprintf(path, sizeof path, "%s/%s", watch.wdPaths[e->wd], e->name) >= (int) sizeof path)
+			continue;
+		watchPath(fd, path);
 	}
+	return lost ? -1 : 0;
+}
+
+static void watchRoots(struct finddups *fd)
+{
+	struct pollfd pfd;
+	char buf[65536] __attribute__ ((aligned(8)));
+	double now, first = 0, last = 0;
+	ssize_t nr;
+	int timeout, r;
 
-	for (i = 1; i < argc; ++i) {
-		j = nftw(argv[i], visit, 64, FTW_PHYS);
-		if (j == -1) {
-			DEBUG_PRINT("returned %d, errno = %d\n", j, errno);
+	if (fanStart())
+		inoStart();
+	fprintf(stderr, "finddups: watching with %s\n", watch.fan ? "fanotify" : "inotify");
+	catchSignals();
+	pfd.fd = watch.fd;
+	pfd.events = POLLIN;
+	while (!stopping) {
+		timeout = -1;
+		if (first) {
+			now = wallNow();
+			timeout = 1000 * (last + WATCH_SETTLE < first + WATCH_MAX_DELAY
+					? last + WATCH_SETTLE - now : first + WATCH_MAX_DELAY - now);
+			if (timeout < 0)
+				timeout = 0;
+		}
+		if ((r = poll(&pfd, 1, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("poll");
+		}
+		if (!r) {
+			finddups_run(fd);
+			sinkFlush();
+			first = 0;
+			continue;
+		}
+		if ((nr = read(watch.fd, buf, sizeof buf)) <= 0) {
+			if (nr < 0 && errno == EINTR)
+				continue;
+			die("Error reading events");
 		}
+		if ((watch.fan ? fanEvents(fd, buf, nr) : inoEvents(fd, buf, nr)) < 0)
+			rewalk(fd);
+		last = wallNow();
+		if (!first)
+			first = last;
 	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: finddups [--order=auto|physical|none] [--hdd-depth=N] [--ssd-depth=N]\n"
+			"                [--small-budget=BYTES] [--pipeline[=THREADS]]\n"
+			"                [--format=text|jsonl|nul|binary] [--stats[=text|json]]\n"
+			"                [--trace=FILE] [--backend=posix|mmap|io_uring|mem[:ARGS]]\n"
+			"                [--progress[=FD]] [--metrics=FILE [--metrics-interval=SECONDS]]\n"
+			"                [--snapshot=FILE] [--read-index=FILE]... [--write-index=FILE\n"
+			"                [--index-digests]] [--checkpoint=FILE [--checkpoint-interval=SECONDS]\n"
+			"                [--resume]] [--shard=K/N [--shard-by=size|root]] [--scan-only]\n"
+			"                [--cross-root] [--ref=DIR]...\n"
+			"                [dir1 ... [dirN]]\n"
+			"       finddups --serve=SOCKET [options] [dir1 ... [dirN]]\n"
+			"       finddups --watch [options] dir1 [dir2 ... [dirN]]\n");
+	exit(EX_USAGE);
+}
 
-	DEBUG_PRINT("Done scanning directory tree. Now starting duplicate checks.\n");
+int main(int argc, char **argv)
+{
+	struct finddups *fd = finddups_new();
+	const char *socketPath = NULL, *snapshotPath = NULL, *indexPath = NULL, *checkpointPath = NULL;
+	const char **readIndexes = calloc(argc, sizeof (char *)), **refs = calloc(argc, sizeof (char *));
+	char *path;
+	int i, n, statsFormat = 0, traced = 0, watching = 0, indexDigests = 0, nreadIndexes = 0;
+	int checkpointInterval = 300, resuming = 0, shard = 0, nshards = 0, shardRoots = 0, scanOnly = 0;
+	int nrefs = 0;
+	static const struct option opts[] = {
+		{"order", required_argument, NULL, 'o'},
+		{"hdd-depth", required_argument, NULL, 'H'},
+		{"ssd-depth", required_argument, NULL, 'S'},
+		{"small-budget", required_argument, NULL, 'M'},
+		{"pipeline", optional_argument, NULL, 'p'},
+		{"format", required_argument, NULL, 'f'},
+		{"stats", optional_argument, NULL, 's'},
+		{"trace", required_argument, NULL, 't'},
+		{"backend", required_argument, NULL, 'b'},
+		{"progress", optional_argument, NULL, 'P'},
+		{"metrics", required_argument, NULL, 'm'},
+		{"metrics-interval", required_argument, NULL, 'i'},
+		{"serve", required_argument, NULL, 'D'},
+		{"watch", no_argument, NULL, 'w'},
+		{"snapshot", required_argument, NULL, 'n'},
+		{"read-index", required_argument, NULL, 'r'},
+		{"write-index", required_argument, NULL, 'W'},
+		{"index-digests", no_argument, NULL, 'd'},
+		{"checkpoint", required_argument, NULL, 'c'},
+		{"checkpoint-interval", required_argument, NULL, 'I'},
+		{"resume", no_argument, NULL, 'R'},
+		{"shard", required_argument, NULL, 'k'},
+		{"shard-by", required_argument, NULL, 'K'},
+		{"scan-only", no_argument, NULL, 'x'},
+		{"cross-root", no_argument, NULL, 'X'},
+		{"ref", required_argument, NULL, 'e'},
+		{NULL, 0, NULL, 0}
+	};
 
-	for (dups = chkForDups(root, NULL); dups; dups = dups->next) {
-		printf("duplicates of size %ld\n", dups->size);
-		for (fp = dups->files; fp; fp = fp->next) {
-			printf("%s\n", fp->name);
+	while ((i = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (i) {
+		case 'o':
+			if (!strcmp(optarg, "auto"))
+				finddups_set_order(fd, FINDDUPS_ORDER_AUTO);
+			else if (!strcmp(optarg, "physical"))
+				finddups_set_order(fd, FINDDUPS_ORDER_PHYSICAL);
+			else if (!strcmp(optarg, "none"))
+				finddups_set_order(fd, FINDDUPS_ORDER_NONE);
+			else
+				usage();
+			break;
+		case 'H':
+			if ((n = atoi(optarg)) < 1)
+				usage();
+			finddups_set_depths(fd, n, 0);
+			break;
+		case 'S':
+			if ((n = atoi(optarg)) < 1)
+				usage();
+			finddups_set_depths(fd, 0, n);
+			break;
+		case 'M':
+			finddups_set_small_budget(fd, strtoul(optarg, NULL, 0));
+			break;
+		case 'p':
+			if ((n = optarg ? atoi(optarg) : 2) < 1)
+				usage();
+			finddups_set_hash_threads(fd, n);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				format = FMT_TEXT;
+			else if (!strcmp(optarg, "jsonl"))
+				format = FMT_JSONL;
+			else if (!strcmp(optarg, "nul"))
+				format = FMT_NUL;
+			else if (!strcmp(optarg, "binary"))
+				format = FMT_BINARY;
+			else
+				usage();
+			break;
+		case 's':
+			if (!optarg || !strcmp(optarg, "text"))
+				statsFormat = 1;
+			else if (!strcmp(optarg, "json"))
+				statsFormat = 2;
+			else
+				usage();
+			break;
+		case 't':
+			if (finddups_trace_open(optarg))
+				die(optarg);
+			traced = 1;
+			break;
+		case 'P':
+			if ((progress.fd = optarg ? atoi(optarg) : 2) < 0)
+				usage();
+			break;
+		case 'm':
+			metricsPath = optarg;
+			break;
+		case 'i':
+			if ((metricsInterval = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'w':
+			watching = 1;
+			break;
+		case 'D':
+			socketPath = optarg;
+			break;
+		case 'n':
+			snapshotPath = optarg;
+			/* missing on a first run */
+			if (finddups_snapshot_load(fd, optarg) && errno != ENOENT)
+				fprintf(stderr, "finddups: ignoring snapshot %s: %s\n", optarg, strerror(errno));
+			break;
+		case 'r':
+			readIndexes[nreadIndexes++] = optarg;
+			break;
+		case 'W':
+			indexPath = optarg;
+			break;
+		case 'd':
+			indexDigests = 1;
+			break;
+		case 'c':
+			checkpointPath = optarg;
+			break;
+		case 'I':
+			if ((checkpointInterval = atoi(optarg)) < 1)
+				usage();
+			break;
+		case 'R':
+			resuming = 1;
+			break;
+		case 'k':
+			if (sscanf(optarg, "%d/%d%n", &shard, &nshards, &n) != 2 || optarg[n]
+					|| shard < 0 || shard >= nshards)
+				usage();
+			break;
+		case 'K':
+			if (!strcmp(optarg, "size"))
+				shardRoots = 0;
+			else if (!strcmp(optarg, "root"))
+				shardRoots = 1;
+			else
+				usage();
+			break;
+		case 'x':
+			scanOnly = 1;
+			break;
+		case 'X':
+			finddups_set_cross_root(fd, 1);
+			break;
+		case 'e':
+			refs[nrefs++] = optarg;
+			break;
+		case 'b':
+			if (finddups_set_backend(fd, optarg)) {
+				if (strcmp(optarg, "io_uring"))
+					usage();
+				fprintf(stderr, "finddups: io_uring unavailable, using posix\n");
+			}
+			break;
+		default:
+			usage();
 		}
 	}
+
+	if ((optind >= argc && !socketPath && !nreadIndexes) || (watching && socketPath)
+			|| (indexDigests && !indexPath) || (resuming && (!checkpointPath || snapshotPath))
+			|| (scanOnly && (watching || socketPath)))
+		usage();
+	if (nshards && !shardRoots)
+		finddups_set_shard(fd, shard, nshards);
+
+	if (format == FMT_BINARY && !socketPath)
+		sinkStr(BINARY_MAGIC);
+
+	finddups_set_callback(fd, emitGroup, NULL);
+	finddups_set_error_callback(fd, onUnreadable, NULL);
+	runStart = wallNow();
+	if (progress.fd >= 0 || (metricsPath && metricsInterval))
+		startProgress(fd);
+
+	if (watching) {
+		const char *root;
+		/* events name files by absolute path, so the index must too */
+		watch.nrefs = nrefs;
+		watch.nroots = nrefs + argc - optind;
+		if (!(watch.roots = malloc(watch.nroots * sizeof (char *))))
+			exit(2);
+		for (i = 0; i < watch.nroots; ++i) {
+			root = i < nrefs ? refs[i] : argv[optind + i - nrefs];
+			if (!(path = realpath(root, NULL)))
+				die(root);
+			watch.roots[i] = path;
+			if (i < nrefs)
+				refs[i] = path;
+			else
+				argv[optind + i - nrefs] = path;
+		}
+	}
+	/* with no checkpoint yet, there is nothing to resume */
+	if (resuming && finddups_resume(fd, checkpointPath) && errno != ENOENT)
+		die(checkpointPath);
+	if (checkpointPath)
+		finddups_set_checkpoint(fd, checkpointPath, checkpointInterval);
+	for (i = 0; i < nreadIndexes; ++i)
+		if (finddups_read_index(fd, readIndexes[i]))
+			die(readIndexes[i]);
+	/* reference dirs come first, also when sharding by root */
+	for (i = 0; i < nrefs; ++i)
+		if (!shardRoots || i % nshards == shard)
+			finddups_add_ref_root(fd, refs[i]);
+	for (i = optind; i < argc; ++i)
+		if (!shardRoots || (nrefs + i - optind) % nshards == shard)
+			finddups_add_root(fd, argv[i]);
+	if (socketPath) {
+		serve(fd, socketPath);
+	} else if (!scanOnly) {
+		finddups_run(fd);
+		sinkFlush();
+	}
+	if (watching) {
+		finddups_set_new_only(fd, 1);
+		watchRoots(fd);
+	}
+
+	if (progress.fd >= 0 || (metricsPath && metricsInterval))
+		stopProgress();
+	if (snapshotPath && finddups_snapshot_save(fd, snapshotPath))
+		perror(snapshotPath);
+	if (indexPath && finddups_write_index(fd, indexPath, indexDigests))
+		perror(indexPath);
+	/* the run got to the end, so there is nothing to resume */
+	if (checkpointPath)
+		unlink(checkpointPath);
+	if (traced)
+		finddups_trace_close();
+	reportUnreadable();
+	if (statsFormat)
+		printStats(fd, stderr, statsFormat == 2);
+	if (metricsPath)
+		writeMetrics(fd, 0);
+	finddups_free(fd);
+	free(readIndexes);
+	free(refs);
 	return 0;
 }
-
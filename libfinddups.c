@@ -0,0 +1,3846 @@
+/* libfinddups - duplicate file detection behind finddups; see libfinddups.h
+ *
+ * Copyright 2012, Alex Stangl
+ * License: OpenBSD/ISC.  See file LICENSE for full text of license.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "libfinddups.h"
+
+/*@-exitarg@*/
+
+/* buffer size default value; override when compiling with -DBUFSIZE=... */
+#if !defined(BUFSIZE)
+#define BUFSIZE 1024
+#endif
+
+/* built with -DFINDDUPS_BENCH, bench/cmpbench.c sets the read size and the
+ * compare kernel at run time; see finddups_bench_compare
+ */
+#if defined(FINDDUPS_BENCH)
+static size_t benchBufsize = BUFSIZE;
+static size_t (*benchKernel)(const char *, const char *, size_t);
+#undef BUFSIZE
+#define BUFSIZE benchBufsize
+#endif
+
+/* buckets whose files all fit in this many bytes are read whole into memory
+ * and grouped there, instead of compared pairwise; override with finddups_set_small_budget
+ */
+#if !defined(SMALL_BUDGET)
+#define SMALL_BUDGET (1024 * 1024)
+#endif
+
+/* change DEBUG to 1 on next line to enable debug printing */
+#define DEBUG 0
+
+#if DEBUG
+#define DEBUG_PRINT(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...)
+#endif
+
+struct fe {const char *name; struct fe *next; dev_t dev; ino_t inode; int sparse; unsigned long long loc;
+	long size; int hashed; unsigned long long phash; struct fe *hnext; unsigned char *digest;
+	int fresh; struct fe *nnext; long long mtime; int mapped; int failed; int root; int ref;};
+/* parts of an entry that live in a mapped index file rather than the heap */
+#define MAPPED_NAME 1
+#define MAPPED_DIGEST 2
+/* a group of duplicates, kept with its bucket for snapshots */
+struct group {struct group *next; int n; struct fe *files[];};
+/* how far a bucket being compared has got, for checkpoints: rows done and
+ * the column reached in the next, the order of files they refer to, and
+ * what they found
+ */
+struct partial {long row, col; int cnt; struct fe **order; int *flags; long *ar; struct group **groups; int ngroups;};
+/* dirty: files were added or removed since the bucket was last compared
+ * resolving: queued or being compared in the current run
+ */
+struct Node {long size,c; struct fe *files; struct Node *left, *right;int color;
+	struct devInfo **devs; int ndevs; int dirty; struct group *groups;
+	int resolving; struct partial *partial;};
+
+static void error_exit(char *errorMsg, const char *parm)
+{
+	char *msg = errorMsg;
+	if (parm) {
+		msg = malloc(strlen(errorMsg) + strlen(parm) + 1);
+		strcpy(msg, errorMsg);
+		strcat(msg, parm);
+	}
+
+	syslog(LOG_USER, msg);
+	if (parm)
+		free(msg);
+
+	exit(1);
+}
+
+static void *Malloc(size_t bytes)
+{
+	void *retval = malloc(bytes);
+	if (retval == 0)
+		exit(2);
+	return retval;
+}
+
+static char *copystr(const char *from)
+{
+	size_t l = strlen(from);
+	char *retval = Malloc((l+1) * sizeof(char));
+	strcpy(retval, from);
+	return retval;
+}
+
+/* Run statistics, read with finddups_stat. Counters are bumped with
+ * relaxed atomic adds so compare threads can share them without locking.
+ */
+enum {ST_FILES, ST_SIZES, ST_BUCKETS, ST_PAIRS, ST_INFERRED, ST_HASHED,
+	ST_SKIPPED, ST_READ, ST_OPENS, ST_CLOSES, ST_GROUPS, ST_DUPBYTES, ST_ERRORS,
+	ST_DIRS_REUSED, ST_BUCKETS_REUSED, ST_CHECKPOINTS, ST_PRUNED, ST_COUNT};
+static const char *statNames[ST_COUNT] = {"files_scanned", "sizes_seen", "buckets_compared",
+	"pairs_compared", "pairs_inferred_different", "pairs_hash_different", "bytes_skipped",
+	"bytes_read", "opens", "closes", "groups", "duplicate_bytes", "errors",
+	"dirs_reused", "buckets_reused", "checkpoints", "buckets_pruned"};
+
+#define STAT_ADD(ctx, st, n) __atomic_fetch_add(&(ctx)->stats[st], (n), __ATOMIC_RELAXED)
+#define PROGRESS_ADD(ctx, field, n) __atomic_fetch_add(&(ctx)->progress.field, (n), __ATOMIC_RELAXED)
+
+/* wall and CPU seconds spent in a phase of the run */
+struct phase {double wall, cpu;};
+static const char *phaseNames[] = {"scan", "compare"};
+enum {PHASE_SCAN, PHASE_COMPARE, PHASE_COUNT};
+
+static double wallNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* CPU time of the whole process, all threads included */
+static double cpuNow(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* call with start = 1 at beginning of phase, 0 at end */
+static void phaseMark(struct phase *p, int start)
+{
+	double sign = start ? -1 : 1;
+	p->wall += sign * wallNow();
+	p->cpu += sign * cpuNow();
+}
+
+/* length of the well-formed UTF-8 sequence of more than one byte at s, or 0
+ * if there is none (a bad, overlong or surrogate lead, or a cut-off tail)
+ */
+static int utf8Len(const unsigned char *s)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	int n, k;
+	if (*s >= 0xc2 && *s <= 0xdf)
+		n = 2;
+	else if (*s >= 0xe0 && *s <= 0xef)
+		n = 3;
+	else if (*s >= 0xf0 && *s <= 0xf4)
+		n = 4;
+	else
+		return 0;
+	if (*s == 0xe0)
+		lo = 0xa0;
+	else if (*s == 0xed)
+		hi = 0x9f;
+	else if (*s == 0xf0)
+		lo = 0x90;
+	else if (*s == 0xf4)
+		hi = 0x8f;
+	for (k = 1; k < n; ++k, lo = 0x80, hi = 0xbf)
+		if (s[k] < lo || s[k] > hi)
+			return 0;
+	return n;
+}
+
+/* write p as JSON string through put. Valid UTF-8 goes through unchanged
+ * and control characters are escaped as \u00XX. Names are just bytes, so a
+ * byte XX that is not part of valid UTF-8 is written as the lone surrogate
+ * \udcXX (surrogateescape), which no real character is written as
+ */
+void finddups_json(void (*put)(const char *, size_t), const char *p)
+{
+	const char *run;
+	char esc[8];
+	int n;
+	put("\"", 1);
+	for (run = p; *p; ++p) {
+		if (*p != '"' && *p != '\\' && (unsigned char) *p >= 0x20 && (unsigned char) *p < 0x80)
+			continue;
+		if ((unsigned char) *p >= 0x80 && (n = utf8Len((const unsigned char *) p))) {
+			p += n - 1;
+			continue;
+		}
+		put(run, p - run);
+		run = p + 1;
+		if (*p == '"' || *p == '\\') {
+			put("\\", 1);
+			put(p, 1);
+		} else if ((unsigned char) *p >= 0x80) {
+			put(esc, snprintf(esc, sizeof esc, "\\udc%02x", (unsigned char) *p));
+		} else {
+			put(esc, snprintf(esc, sizeof esc, "\\u%04x", (unsigned char) *p));
+		}
+	}
+	put(run, p - run);
+	put("\"", 1);
+}
+
+/* Optional Chrome trace-event output (finddups_trace_open), loadable in
+ * chrome://tracing or Perfetto. Each span is a complete ("X") event written
+ * when it ends. With tracing off, the only cost is a test of traceFile.
+ */
+static FILE *traceFile;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static double traceStart;
+static long traceEvents;      /* events written so far */
+static int traceArgs;         /* arguments written for current event */
+
+static void traceWrite(const char *p, size_t n)
+{
+	fwrite(p, 1, n, traceFile);
+}
+
+int finddups_trace_open(const char *path)
+{
+	if ((traceFile = fopen(path, "w")) == NULL)
+		return -1;
+	setvbuf(traceFile, NULL, _IOFBF, 1024 * 1024);
+	fputs("[\n", traceFile);
+	traceStart = wallNow();
+	return 0;
+}
+
+void finddups_trace_close(void)
+{
+	fputs("\n]\n", traceFile);
+	if (fclose(traceFile))
+		error_exit("Error writing trace file", NULL);
+	traceFile = NULL;
+}
+
+/* start writing span of given category that began at start (a wallNow()
+ * value) and ends now; follow with any traceArg calls, then traceEnd
+ */
+static void traceBegin(const char *cat, const char *name, double start)
+{
+	static __thread pid_t tid;
+	double end = wallNow();
+	if (!tid)
+		tid = gettid();
+	pthread_mutex_lock(&traceLock);
+	fprintf(traceFile, "%s{\"cat\":\"%s\",\"name\":", traceEvents++ ? ",\n" : "", cat);
+	finddups_json(traceWrite, name);
+	fprintf(traceFile, ",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":%d,\"tid\":%d,\"args\":{",
+			(start - traceStart) * 1e6, (end - start) * 1e6, (int) getpid(), (int) tid);
+	traceArgs = 0;
+}
+
+static void traceArgStr(const char *key, const char *v)
+{
+	fprintf(traceFile, "%s\"%s\":", traceArgs++ ? "," : "", key);
+	finddups_json(traceWrite, v);
+}
+
+static void traceArgNum(const char *key, long long v)
+{
+	fprintf(traceFile, "%s\"%s\":%lld", traceArgs++ ? "," : "", key, v);
+}
+
+static void traceEnd(void)
+{
+	fputs("}}", traceFile);
+	pthread_mutex_unlock(&traceLock);
+}
+
+/* I/O backends. All traversal and file content access goes through the
+ * context's backend (finddups_set_backend):
+ *   posix     nftw, open, pread
+ *   mmap      files are mapped whole, and compared in place without copying
+ *   io_uring  reads of a batch (both sides of a pair, or a run of small
+ *             files) are submitted together through a per-thread ring
+ *   mem       synthetic in-memory filesystem; see memInit for its ARGS
+ */
+
+/* one read for readBatch; res gets bytes read, or -1 with the error in err,
+ * since errno after a batch only tells of one of its failures
+ */
+struct ioReq {int h; void *buf; size_t n; off_t pos; ssize_t res; int err;};
+
+typedef int (*visitFn)(const char *, const struct stat *, int, struct FTW *);
+
+struct backend {
+	const char *name;
+	int realFds;                 /* handles are OS file descriptors */
+	int (*init)(const char *args);
+	int (*walk)(const char *root, visitFn fn);
+	int (*open)(const char *name);
+	void (*readBatch)(struct ioReq *reqs, int n);
+	/* direct pointer to n bytes at pos, or NULL; op itself may be NULL */
+	const char *(*view)(int h, off_t pos, size_t n);
+	void (*close)(int h);
+};
+
+static int posixWalk(const char *root, visitFn fn)
+{
+	return nftw(root, fn, 64, FTW_PHYS);
+}
+
+static int posixOpen(const char *name)
+{
+	return open(name, O_RDONLY);
+}
+
+static void posixReadBatch(struct ioReq *reqs, int n)
+{
+	for (; n--; ++reqs)
+		if ((reqs->res = pread(reqs->h, reqs->buf, reqs->n, reqs->pos)) < 0)
+			reqs->err = errno;
+}
+
+static void posixClose(int h)
+{
+	close(h);
+}
+
+/* mmap backend: mapping of each open file, indexed by its descriptor */
+static struct mapping {const char *p; off_t size;} *maps;
+static long nmaps;
+
+static int mmapInit(const char *args)
+{
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	nmaps = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1048576 ? 1048576 : rl.rlim_cur;
+	maps = calloc(nmaps, sizeof (struct mapping));
+	return maps ? 0 : -1;
+}
+
+static int mmapOpen(const char *name)
+{
+	struct stat st;
+	void *p = NULL;
+	int fd;
+	if ((fd = open(name, O_RDONLY)) < 0)
+		return fd;
+	if (fd >= nmaps || fstat(fd, &st)) {
+		close(fd);
+		errno = EMFILE;
+		return -1;
+	}
+	if (st.st_size > 0 && (p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		p = NULL;
+	maps[fd].p = p;
+	maps[fd].size = p ? st.st_size : 0;
+	return fd;
+}
+
+static const char *mmapView(int h, off_t pos, size_t n)
+{
+	return maps[h].p && pos + (off_t) n <= maps[h].size ? maps[h].p + pos : NULL;
+}
+
+static void mmapReadBatch(struct ioReq *reqs, int n)
+{
+	const char *p;
+	for (; n--; ++reqs) {
+		if ((p = mmapView(reqs->h, reqs->pos, reqs->n)) != NULL) {
+			memcpy(reqs->buf, p, reqs->n);
+			reqs->res = reqs->n;
+		} else if ((reqs->res = pread(reqs->h, reqs->buf, reqs->n, reqs->pos)) < 0) {
+			reqs->err = errno;
+		}
+	}
+}
+
+static void mmapClose(int h)
+{
+	if (maps[h].p)
+		munmap((void *) maps[h].p, maps[h].size);
+	maps[h].p = NULL;
+	close(h);
+}
+
+/* io_uring backend, over raw system calls so there is no liburing dependency.
+ * Each thread gets its own ring, torn down when the thread exits.
+ */
+#define RING_ENTRIES 64
+
+struct ring {
+	int fd;
+	unsigned *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq, *cq;
+	size_t sqsz, cqsz, sqesz;
+};
+static pthread_key_t ringKey;
+
+static void ringFree(void *p)
+{
+	struct ring *r = p;
+	munmap(r->sqes, r->sqesz);
+	if (r->cq != r->sq)
+		munmap(r->cq, r->cqsz);
+	munmap(r->sq, r->sqsz);
+	close(r->fd);
+	free(r);
+}
+
+static struct ring *ringGet(void)
+{
+	struct io_uring_params p;
+	struct ring *r = pthread_getspecific(ringKey);
+	char *sq, *cq;
+	if (r)
+		return r;
+	r = Malloc(sizeof (struct ring));
+	memset(&p, 0, sizeof p);
+	if ((r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) < 0) {
+		free(r);
+		return NULL;
+	}
+	r->sqsz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	r->cqsz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sqsz = r->cqsz = r->sqsz > r->cqsz ? r->sqsz : r->cqsz;
+	r->sqesz = p.sq_entries * sizeof (struct io_uring_sqe);
+	r->sq = mmap(NULL, r->sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq
+		: mmap(NULL, r->cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqesz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqesz);
+		if (r->cq != MAP_FAILED && r->cq != r->sq)
+			munmap(r->cq, r->cqsz);
+		if (r->sq != MAP_FAILED)
+			munmap(r->sq, r->sqsz);
+		close(r->fd);
+		free(r);
+		return NULL;
+	}
+	sq = r->sq;
+	cq = r->cq;
+	r->sqTail = (unsigned *) (sq + p.sq_off.tail);
+	r->sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned *) (sq + p.sq_off.array);
+	r->cqHead = (unsigned *) (cq + p.cq_off.head);
+	r->cqTail = (unsigned *) (cq + p.cq_off.tail);
+	r->cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	pthread_setspecific(ringKey, r);
+	return r;
+}
+
+static int uringInit(const char *args)
+{
+	if (pthread_key_create(&ringKey, ringFree))
+		return -1;
+	return ringGet() ? 0 : -1;
+}
+
+/* reads go through pread where the thread has no ring (the kernel refused
+ * one), and from the batch on where waiting for it failed
+ */
+static void uringReadBatch(struct ioReq *reqs, int n)
+{
+	struct ring *r = ringGet();
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct iovec iov[RING_ENTRIES];
+	unsigned tail, head;
+	unsigned long long done;     /* requests of the batch completed */
+	int k, batch, pending, err;
+
+	for (; n > 0; n -= batch, reqs += batch) {
+		if (!r) {
+			posixReadBatch(reqs, n);
+			return;
+		}
+		batch = n < RING_ENTRIES ? n : RING_ENTRIES;
+		tail = *r->sqTail;
+		for (k = 0; k < batch; ++k, ++tail) {
+			sqe = &r->sqes[tail & *r->sqMask];
+			memset(sqe, 0, sizeof *sqe);
+			/* READV, as plain READ needs Linux 5.6 and rings go back to 5.1 */
+			iov[k].iov_base = reqs[k].buf;
+			iov[k].iov_len = reqs[k].n;
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = reqs[k].h;
+			sqe->addr = (unsigned long) &iov[k];
+			sqe->len = 1;
+			sqe->off = reqs[k].pos;
+			sqe->user_data = k;
+			r->sqArray[tail & *r->sqMask] = tail & *r->sqMask;
+		}
+		__atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+		for (done = 0, pending = batch, k = batch; pending > 0; k = 0) {
+			err = syscall(__NR_io_uring_enter, r->fd, k, pending, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+				&& errno != EINTR ? errno : 0;
+			head = *r->cqHead;
+			for (; head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE); ++head, --pending) {
+				cqe = &r->cqes[head & *r->cqMask];
+				done |= 1ULL << cqe->user_data;
+				if ((reqs[cqe->user_data].res = cqe->res) < 0) {
+					errno = reqs[cqe->user_data].err = -cqe->res;
+					reqs[cqe->user_data].res = -1;
+				}
+			}
+			__atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+			if (err && pending > 0) {
+				/* what is left of the batch may or may not have been
+				 * submitted, so it fails with err, and the ring, whose
+				 * state is unknown now, goes
+				 */
+				for (k = 0; k < batch; ++k)
+					if (!(done >> k & 1)) {
+						reqs[k].res = -1;
+						reqs[k].err = err;
+					}
+				errno = err;
+				pthread_setspecific(ringKey, NULL);
+				ringFree(r);
+				r = NULL;
+				break;
+			}
+		}
+	}
+}
+
+/* mem backend: a synthetic filesystem whose files exist only as a function
+ * of their index, so neither contents nor metadata take any memory.
+ * ARGS are comma-separated key=value settings:
+ *   files=N    number of files per root (default 100000)
+ *   seed=N     makes different trees from the same settings
+ *   dups=F     fraction of files that copy an earlier file
+ *   near=F     fraction that copy an earlier file but differ halfway through
+ *   maxsize=N  sizes are spread log-uniformly from about sqrt(N) up to N
+ * Files are named ROOT/INDEX.
+ */
+static struct {long files; unsigned long long seed, maxsize; double dups, near;} mem =
+	{100000, 1, 1 << 20, 0.2, 0.2};
+
+struct memFile {unsigned long long seed, size, diverge, flip;};
+
+static unsigned long long mix(unsigned long long x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* work out contents of file i by following its chain of copies back to an
+ * original; only the first near-copy on the chain changes anything
+ */
+static void memSpec(long i, struct memFile *f)
+{
+	unsigned long long h;
+	double u;
+	int near = 0;
+	int bits;
+	for (;;) {
+		h = mix(mem.seed * 0x100000001b3ULL + i);
+		u = (h >> 11) * (1.0 / 9007199254740992.0);
+		if (i > 0 && u < mem.dups + mem.near) {
+			if (u >= mem.dups && !near) {
+				near = 1;
+				f->flip = 1 + mix(h) % 255;
+			}
+			i = mix(h ^ 1) % i;
+			continue;
+		}
+		f->seed = h;
+		for (bits = 0; (1ULL << bits) < mem.maxsize; ++bits);
+		bits -= mix(h ^ 2) % (bits / 2 + 1);
+		f->size = (1ULL << bits) / 2 + 1 + mix(h ^ 3) % ((1ULL << bits) / 2);
+		if (f->size > mem.maxsize)
+			f->size = mem.maxsize;
+		f->diverge = near ? f->size / 2 : ~0ULL;
+		return;
+	}
+}
+
+static int memInit(const char *args)
+{
+	char *end;
+	while (args && *args) {
+		if (!strncmp(args, "files=", 6))
+			mem.files = strtol(args + 6, &end, 0);
+		else if (!strncmp(args, "seed=", 5))
+			mem.seed = strtoull(args + 5, &end, 0);
+		else if (!strncmp(args, "dups=", 5))
+			mem.dups = strtod(args + 5, &end);
+		else if (!strncmp(args, "near=", 5))
+			mem.near = strtod(args + 5, &end);
+		else if (!strncmp(args, "maxsize=", 8))
+			mem.maxsize = strtoull(args + 8, &end, 0);
+		else
+			return -1;
+		if (*end && *end != ',')
+			return -1;
+		args = *end ? end + 1 : end;
+	}
+	return mem.files > 0 && mem.maxsize > 0 ? 0 : -1;
+}
+
+static int memWalk(const char *root, visitFn fn)
+{
+	static int roots;
+	struct memFile f;
+	struct stat st;
+	struct FTW ftw;
+	char *name;
+	size_t len = strlen(root);
+	long i;
+	name = Malloc(len + 24);
+	memset(&st, 0, sizeof st);
+	st.st_mode = S_IFREG | 0444;
+	st.st_nlink = 1;
+	st.st_dev = makedev(0, ++roots);	/* roots are copies, not hard links */
+	ftw.base = len + 1;
+	ftw.level = 1;
+	for (i = 0; i < mem.files; ++i) {
+		memSpec(i, &f);
+		st.st_ino = i + 1;
+		st.st_size = f.size;
+		st.st_blocks = (f.size + 511) / 512;
+		snprintf(name, len + 24, "%s/%ld", root, i);
+		if (fn(name, &st, FTW_F, &ftw))
+			break;
+	}
+	free(name);
+	return 0;
+}
+
+static int memOpen(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	long i = atol(base ? base + 1 : name);
+	if (i < 0 || i >= mem.files) {
+		errno = ENOENT;
+		return -1;
+	}
+	return i;
+}
+
+static void memReadBatch(struct ioReq *reqs, int n)
+{
+	struct memFile f;
+	unsigned long long w = 0, p, end;
+	unsigned char *out;
+	for (; n--; ++reqs) {
+		memSpec(reqs->h, &f);
+		end = reqs->pos + reqs->n < f.size ? reqs->pos + reqs->n : f.size;
+		out = reqs->buf;
+		for (p = reqs->pos; p < end; ++p) {
+			if (p == reqs->pos || !(p & 7))
+				w = mix(f.seed + (p >> 3));
+			*out++ = (w >> ((p & 7) * 8)) ^ (p == f.diverge ? f.flip : 0);
+		}
+		reqs->res = reqs->pos < (off_t) end ? (ssize_t) (end - reqs->pos) : 0;
+	}
+}
+
+static void memClose(int h)
+{
+}
+
+static const struct backend backends[] = {
+	{"posix", 1, NULL, posixWalk, posixOpen, posixReadBatch, NULL, posixClose},
+	{"mmap", 1, mmapInit, posixWalk, mmapOpen, mmapReadBatch, mmapView, mmapClose},
+	{"io_uring", 1, uringInit, posixWalk, posixOpen, uringReadBatch, NULL, posixClose},
+	{"mem", 0, memInit, memWalk, memOpen, memReadBatch, NULL, memClose},
+};
+
+/* look up backend from NAME[:ARGS] and start it; NULL if unknown or it won't */
+static const struct backend *findBackend(const char *spec)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t) (colon - spec) : strlen(spec);
+	unsigned k;
+	for (k = 0; k < sizeof backends / sizeof backends[0]; ++k) {
+		if (strlen(backends[k].name) != len || strncmp(backends[k].name, spec, len))
+			continue;
+		if (backends[k].init && backends[k].init(colon ? colon + 1 : NULL))
+			return NULL;
+		return &backends[k];
+	}
+	return NULL;
+}
+
+/* everything one index and its runs need */
+struct finddups {
+	const struct backend *io;
+	struct Node *root;
+	unsigned long smallBudget;
+	enum finddups_order order;
+	int hddDepth, ssdDepth;
+	finddups_group_fn onGroup;
+	void *onGroupArg;
+	finddups_error_fn onError;
+	void *onErrorArg;
+
+	unsigned long long stats[ST_COUNT];
+	struct phase phases[PHASE_COUNT];
+	struct finddups_progress progress;
+
+	/* pipelined prefix hashing */
+	int hashThreads, hashing, hashDone;
+	pthread_t *hashers;
+	pthread_mutex_t hashLock;
+	pthread_cond_t hashCond;
+	struct fe *hashHead, *hashTail;
+
+	/* compare scheduling */
+	struct devInfo *devices;
+	pthread_mutex_t schedLock;
+	pthread_cond_t schedCond;
+	long pending;
+	struct Node **buckets;
+	long nbuckets, maxbuckets;
+
+	int newOnly;                  /* report only groups with fresh files */
+	int shard, nshards;           /* keep only sizes of this shard, if nshards */
+	/* roots in the order added, each file tagged with the one it was found
+	 * under (-1 for none); ids of roots of index files read have no path
+	 */
+	char **rootPaths;
+	char *rootRefs;               /* which roots are reference roots */
+	int nroots, curRoot;
+	int crossRoot;                /* compare only files of different roots */
+	int refs;                     /* some files are of reference roots */
+	/* entries by name, chained through nnext; built on first removal */
+	struct fe **byName;
+	unsigned long byNameMask, byNameCount;
+
+	/* snapshot loaded, by dev/inode and by size, and directories walked since */
+	int snapshotting;
+	char *snapBuf;
+	size_t snapLen;
+	struct snapDir **snapDirs, *snapDirPool;
+	struct snapBucket **snapBuckets, *snapBucketPool;
+	unsigned long snapDirMask, snapBucketMask;
+	struct snapDir **walked;
+	long nwalked, maxwalked;
+
+	/* index files mapped, which entries point into */
+	struct {void *p; size_t len;} *maps;
+	int nmaps;
+
+	/* checkpoints: where and how often, roots walked whole so far, and how
+	 * many more a resumed run skips; running counts compare workers left
+	 */
+	char *checkpointPath;
+	int checkpointInterval, running;
+	double nextCheckpoint;
+	long rootsWalked, skipRoots;
+
+	/* entries that could not be read in this run, dropped once it ends */
+	pthread_mutex_t failLock;
+	struct fe **failed;
+	long nfailed, maxfailed;
+};
+
+static void checkpoint(struct finddups *ctx);
+
+/* counted and traced wrappers around the backend */
+static int openFile(struct finddups *ctx, const char *name)
+{
+	int h = ctx->io->open(name);
+	if (h >= 0)
+		STAT_ADD(ctx, ST_OPENS, 1);
+	return h;
+}
+
+static void closeFile(struct finddups *ctx, int h)
+{
+	ctx->io->close(h);
+	STAT_ADD(ctx, ST_CLOSES, 1);
+}
+
+static void readBatch(struct finddups *ctx, struct ioReq *reqs, int n)
+{
+	double start = traceFile ? wallNow() : 0;
+	int k;
+	ctx->io->readBatch(reqs, n);
+	for (k = 0; k < n; ++k) {
+		if (reqs[k].res > 0)
+			STAT_ADD(ctx, ST_READ, reqs[k].res);
+		if (traceFile) {
+			traceBegin("read", "read", start);
+			traceArgNum("offset", reqs[k].pos);
+			traceArgNum("bytes", reqs[k].res);
+			traceEnd();
+		}
+	}
+}
+
+static ssize_t readAt(struct finddups *ctx, int h, void *buf, size_t n, off_t pos)
+{
+	struct ioReq req;
+	req.h = h;
+	req.buf = buf;
+	req.n = n;
+	req.pos = pos;
+	readBatch(ctx, &req, 1);
+	return req.res;
+}
+
+/* direct access to file contents, when the backend offers it */
+static const char *viewAt(struct finddups *ctx, int h, off_t pos, size_t n)
+{
+	const char *p = ctx->io->view ? ctx->io->view(h, pos, n) : NULL;
+	if (p)
+		STAT_ADD(ctx, ST_READ, n);
+	return p;
+}
+
+static int isRed(struct Node *n) {
+	return n != NULL && n->color;
+}
+
+static void colorFlip(struct Node *n) {
+	assert(n->color == 0);
+	assert(n->left->color == 1);
+	assert(n->right->color == 1);
+	n->color = 1;
+	n->left->color = n->right->color = 0;
+}
+
+static struct Node *rotateLeft(struct Node *h) {
+	struct Node *x = h->right;
+	h->right = x->left;
+	x->left = h;
+	x->color = h->color;
+	h->color = 1;
+	return x;
+}
+
+static struct Node *rotateRight(struct Node *h) {
+	struct Node *x = h->left;
+	h->left = x->right;
+	x->right = h;
+	x->color = h->color;
+	h->color = 1;
+	return x;
+}
+
+static struct fe *newFileNode(const char *name, const struct stat *st)
+{
+	struct fe *retval = malloc(sizeof (struct fe));
+	retval->name = copystr(name);
+	retval->next = NULL;
+	retval->dev = st->st_dev;
+	retval->inode = st->st_ino;
+	retval->size = st->st_size;
+	retval->mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	retval->fresh = 1;
+	/* fewer allocated blocks than the size needs means the file has holes */
+	retval->sparse = (long long) st->st_blocks * 512 < (long long) st->st_size;
+	retval->hashed = 0;
+	retval->loc = 0;
+	retval->digest = NULL;
+	retval->mapped = 0;
+	retval->failed = 0;
+	retval->root = -1;
+	retval->ref = 0;
+	return retval;
+}
+static void freeFiles(struct fe *fp)
+{
+	struct fe *next;
+	for (; fp != NULL; fp = next) {
+		next = fp->next;
+		if (!(fp->mapped & MAPPED_NAME))
+			free((char *) fp->name);
+		if (!(fp->mapped & MAPPED_DIGEST))
+			free(fp->digest);
+		free(fp);
+	}
+}
+
+/* Pipelined mode: once a size has been seen twice, background threads hash
+ * the first PREFIX bytes of each file of that size while traversal goes on.
+ * Pairs whose prefix hashes differ are known to differ without reading them
+ * again in the compare phase.
+ */
+#if !defined(PREFIX)
+#define PREFIX 4096
+#endif
+
+/* 64-bit FNV-1a */
+static unsigned long long fnv(const char *p, size_t n, unsigned long long h)
+{
+	while (n--) {
+		h ^= (unsigned char) *p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void hashPrefix(struct finddups *ctx, struct fe *f, long size)
+{
+	char buff[PREFIX];
+	ssize_t nr;
+	int fd;
+	if ((fd = openFile(ctx, f->name)) < 0)
+		return;
+	nr = readAt(ctx, fd, buff, size < PREFIX ? size : PREFIX, 0);
+	closeFile(ctx, fd);
+	if (nr == (size < PREFIX ? size : PREFIX)) {
+		f->phash = fnv(buff, nr, 14695981039346656037ULL);
+		f->hashed = 1;
+	}
+}
+
+static void *hashWorker(void *arg)
+{
+	struct finddups *ctx = arg;
+	struct fe *f;
+	pthread_mutex_lock(&ctx->hashLock);
+	for (;;) {
+		while (!ctx->hashHead && !ctx->hashDone)
+			pthread_cond_wait(&ctx->hashCond, &ctx->hashLock);
+		if (ctx->hashDone)
+			break;
+		f = ctx->hashHead;
+		if (!(ctx->hashHead = f->hnext))
+			ctx->hashTail = NULL;
+		pthread_mutex_unlock(&ctx->hashLock);
+		hashPrefix(ctx, f, f->size);
+		pthread_mutex_lock(&ctx->hashLock);
+	}
+	pthread_mutex_unlock(&ctx->hashLock);
+	return NULL;
+}
+
+static void queueHash(struct finddups *ctx, struct fe *f, long size)
+{
+	f->size = size;
+	f->hnext = NULL;
+	pthread_mutex_lock(&ctx->hashLock);
+	if (ctx->hashTail)
+		ctx->hashTail->hnext = f;
+	else
+		ctx->hashHead = f;
+	ctx->hashTail = f;
+	pthread_cond_signal(&ctx->hashCond);
+	pthread_mutex_unlock(&ctx->hashLock);
+}
+
+/* start hashing threads, unless they are off or already going */
+static void startHashers(struct finddups *ctx)
+{
+	int t;
+	if (!ctx->hashThreads || ctx->hashing)
+		return;
+	ctx->hashers = Malloc(ctx->hashThreads * sizeof (pthread_t));
+	ctx->hashDone = 0;
+	for (t = 0; t < ctx->hashThreads; ++t)
+		if (pthread_create(&ctx->hashers[t], NULL, hashWorker, ctx))
+			error_exit("Error creating hash thread", NULL);
+	ctx->hashing = 1;
+}
+
+/* adding files is over; whatever is still queued is left for the compare phase */
+static void stopHashers(struct finddups *ctx)
+{
+	int t;
+	if (!ctx->hashing)
+		return;
+	pthread_mutex_lock(&ctx->hashLock);
+	ctx->hashDone = 1;
+	pthread_cond_broadcast(&ctx->hashCond);
+	pthread_mutex_unlock(&ctx->hashLock);
+	for (t = 0; t < ctx->hashThreads; ++t)
+		pthread_join(ctx->hashers[t], NULL);
+	free(ctx->hashers);
+	ctx->hashHead = ctx->hashTail = NULL;
+	ctx->hashing = 0;
+}
+
+/* Index of entries by name, so files can be dropped by path alone. It
+ * costs memory only once something is removed, and is kept up from then on.
+ */
+static unsigned long nameHash(const char *name)
+{
+	return fnv(name, strlen(name), 14695981039346656037ULL);
+}
+
+static void nameAdd(struct finddups *ctx, struct fe *f)
+{
+	struct fe **old, *g, *next;
+	unsigned long k, n;
+	if (!ctx->byName)
+		return;
+	if (ctx->byNameCount > ctx->byNameMask) {
+		old = ctx->byName;
+		n = ctx->byNameMask + 1;
+		ctx->byNameMask = n * 2 - 1;
+		ctx->byName = calloc(n * 2, sizeof (struct fe *));
+		if (!ctx->byName)
+			exit(2);
+		for (k = 0; k < n; ++k)
+			for (g = old[k]; g; g = next) {
+				next = g->nnext;
+				g->nnext = ctx->byName[nameHash(g->name) & ctx->byNameMask];
+				ctx->byName[nameHash(g->name) & ctx->byNameMask] = g;
+			}
+		free(old);
+	}
+	k = nameHash(f->name) & ctx->byNameMask;
+	f->nnext = ctx->byName[k];
+	ctx->byName[k] = f;
+	++ctx->byNameCount;
+}
+
+static void nameAddTree(struct finddups *ctx, struct Node *node)
+{
+	struct fe *f;
+	if (!node)
+		return;
+	for (f = node->files; f; f = f->next)
+		nameAdd(ctx, f);
+	nameAddTree(ctx, node->left);
+	nameAddTree(ctx, node->right);
+}
+
+static void nameBuild(struct finddups *ctx)
+{
+	if (ctx->byName)
+		return;
+	ctx->byNameMask = 1023;
+	ctx->byName = calloc(ctx->byNameMask + 1, sizeof (struct fe *));
+	if (!ctx->byName)
+		exit(2);
+	nameAddTree(ctx, ctx->root);
+}
+
+/* link pointing at the named entry, or at NULL if there is none */
+static struct fe **nameFind(struct finddups *ctx, const char *name)
+{
+	struct fe **link;
+	nameBuild(ctx);
+	for (link = &ctx->byName[nameHash(name) & ctx->byNameMask]; *link; link = &(*link)->nnext)
+		if (!strcmp((*link)->name, name))
+			break;
+	return link;
+}
+
+/* recursive insert called during traversal; takes over f, or frees it
+ * if its file is already in the tree
+ */
+static struct Node *insertR(struct finddups *ctx, struct Node *node, struct fe *f)
+{
+	struct fe *fp;
+	if (!node) {
+		STAT_ADD(ctx, ST_SIZES, 1);
+		node = malloc(sizeof (struct Node));
+		node->size = f->size;
+		node->c = 1;
+		node->dirty = 1;
+		node->devs = NULL;
+		node->groups = NULL;
+		node->resolving = 0;
+		node->partial = NULL;
+		node->left = node->right = NULL;
+		node->files = f;
+		node->color = 1;
+		nameAdd(ctx, f);
+	} else if (f->size == node->size) {
+		/* traverse file list to see if we have same dev/inode as an existing file (e.g., hard link)
+		 * if so, just return existing node unmodified (no need to add this redundant file)
+		 */
+		for (fp = node->files; fp; fp=fp->next) {
+			if (fp->dev == f->dev && fp->inode == f->inode) {
+				freeFiles(f);
+				return node;
+			}
+		}
+		f->next = node->files;
+		node->files = f;
+		nameAdd(ctx, f);
+		++node->c;
+		node->dirty = 1;
+
+		/* size repeats, so start hashing prefixes unless bucket is headed
+		 * for the small-file path, which reads everything anyway
+		 */
+		if (ctx->hashing && (unsigned long) node->size * 2 > ctx->smallBudget) {
+			if (node->c == 2)
+				queueHash(ctx, f->next, node->size);
+			queueHash(ctx, f, node->size);
+		}
+	} else {
+		if (isRed(node->left) && isRed(node->right))
+			colorFlip(node);
+
+		if (f->size < node->size) {
+			node->left = insertR(ctx, node->left, f);
+		} else {
+			node->right = insertR(ctx, node->right, f);
+		}
+
+		if (isRed(node->right) && !isRed(node->left))
+			node = rotateLeft(node);
+
+		if (isRed(node->left) && isRed(node->left->left))
+			node = rotateRight(node);
+	}
+	return node;
+}
+
+/* main entry point for insert, inserting at root */
+static void insertEntry(struct finddups *ctx, struct fe *f) {
+	ctx->root = insertR(ctx, ctx->root, f);
+	ctx->root->color = 0;
+}
+
+/* make room for another root */
+static void growRoots(struct finddups *ctx)
+{
+	if (!(ctx->rootPaths = realloc(ctx->rootPaths, (ctx->nroots + 1) * sizeof (char *)))
+			|| !(ctx->rootRefs = realloc(ctx->rootRefs, ctx->nroots + 1)))
+		exit(2);
+}
+
+/* id of root at path, the one it had if added before */
+static int rootId(struct finddups *ctx, const char *path, int ref)
+{
+	int k;
+	for (k = 0; k < ctx->nroots && !(ctx->rootPaths[k] && !strcmp(ctx->rootPaths[k], path)); ++k);
+	if (k == ctx->nroots) {
+		growRoots(ctx);
+		ctx->rootPaths[ctx->nroots++] = copystr(path);
+	}
+	ctx->rootRefs[k] = ref;
+	ctx->refs |= ref;
+	return k;
+}
+
+/* id of the innermost root holding path, or -1 */
+static int rootOf(struct finddups *ctx, const char *path)
+{
+	size_t len, best = 0;
+	int k, r = -1;
+	for (k = 0; k < ctx->nroots; ++k) {
+		if (!ctx->rootPaths[k])
+			continue;
+		len = strlen(ctx->rootPaths[k]);
+		while (len > 1 && ctx->rootPaths[k][len-1] == '/')
+			--len;
+		if (len >= best && !strncmp(path, ctx->rootPaths[k], len) && (path[len] == '/' || !path[len])) {
+			best = len;
+			r = k;
+		}
+	}
+	return r;
+}
+
+/* whether files of size belong in this context's shard. Sizes are spread
+ * over shards by hash, so each bucket lives whole in exactly one of them.
+ */
+static int inShard(struct finddups *ctx, long size)
+{
+	return !ctx->nshards || mix(size) % ctx->nshards == (unsigned long long) ctx->shard;
+}
+
+static void insert(struct finddups *ctx, const char *name, const struct stat *st, int root) {
+	struct fe *f;
+	/*
+	DEBUG_PRINT("Inserting %s with size %ld\n", name, st->st_size);
+	*/
+	if (!inShard(ctx, st->st_size))
+		return;
+	f = newFileNode(name, st);
+	f->root = root;
+	f->ref = root >= 0 && ctx->rootRefs[root];
+	insertEntry(ctx, f);
+}
+
+/* directories being traced, indexed by nftw level. A directory's span runs
+ * until traversal next reaches an entry at its own level or above.
+ */
+static struct {char *name; double start;} *dirSpans;
+static int nDirSpans, maxDirSpans;
+
+/* end spans of directories at level and deeper */
+static void traceDirs(int level)
+{
+	while (nDirSpans > level) {
+		--nDirSpans;
+		traceBegin("scan", dirSpans[nDirSpans].name, dirSpans[nDirSpans].start);
+		traceEnd();
+		free(dirSpans[nDirSpans].name);
+	}
+}
+
+/* context being walked by this thread, since nftw passes visit no argument */
+static __thread struct finddups *walking;
+
+static int visit(const char *name, const struct stat *st, int flag, struct FTW *ftw) {
+	/*
+	DEBUG_PRINT("name = %s, flag = %d, st = %ld\n", name, flag, st);
+	DEBUG_PRINT("visiting %s with size %ld\n", name, st->st_size);
+	*/
+	if (traceFile) {
+		traceDirs(ftw->level);
+		if (flag == FTW_D) {
+			if (nDirSpans == maxDirSpans) {
+				maxDirSpans = maxDirSpans ? maxDirSpans * 2 : 64;
+				dirSpans = realloc(dirSpans, maxDirSpans * sizeof *dirSpans);
+				if (!dirSpans)
+					exit(2);
+			}
+			dirSpans[nDirSpans].name = copystr(name);
+			dirSpans[nDirSpans++].start = wallNow();
+		}
+	}
+	if (flag == FTW_F) {
+		STAT_ADD(walking, ST_FILES, 1);
+		insert(walking, name, st, walking->curRoot);
+		if (walking->checkpointPath && wallNow() >= walking->nextCheckpoint)
+			checkpoint(walking);
+	} else if (flag == FTW_DNR || flag == FTW_NS) {
+		DEBUG_PRINT("Cannot %s %s\n", flag == FTW_DNR ? "read" : "stat", name);
+		STAT_ADD(walking, ST_ERRORS, 1);
+	}
+	return 0;
+}
+
+/* Cross-root mode reports only what one root duplicates of another: pairs
+ * under the same root are never compared, buckets confined to one root are
+ * skipped, and groups must span roots. Files added outside any root count
+ * as one root of their own.
+ * Reference roots hold files already known to be distinct, so two of their
+ * files are never compared, and only groups with a candidate (a file of
+ * another root) are reported.
+ */
+static int pairAllowed(struct finddups *ctx, struct fe *a, struct fe *b)
+{
+	return (!ctx->crossRoot || a->root != b->root) && !(a->ref && b->ref);
+}
+
+/* whether any pair of same-size files may be compared; if so, one with
+ * the first candidate may
+ */
+static int groupAllowed(struct finddups *ctx, struct fe **files, int n)
+{
+	int c, k;
+	for (c = 0; c < n && files[c]->ref; ++c);
+	for (k = 0; c < n && k < n; ++k)
+		if (k != c && pairAllowed(ctx, files[c], files[k]))
+			return 1;
+	return 0;
+}
+
+static int bucketAllowed(struct finddups *ctx, struct Node *node)
+{
+	struct fe *c, *fp;
+	for (c = node->files; c && c->ref; c = c->next);
+	for (fp = node->files; c && fp; fp = fp->next)
+		if (fp != c && pairAllowed(ctx, c, fp))
+			return 1;
+	return 0;
+}
+
+/* move candidates ahead of reference files, keeping the order of each */
+static void candidatesFirst(struct Node *node)
+{
+	struct fe *cand = NULL, *ref = NULL, **ct = &cand, **rt = &ref, *fp;
+	for (fp = node->files; fp; fp = fp->next)
+		if (fp->ref) {
+			*rt = fp;
+			rt = &fp->next;
+		} else {
+			*ct = fp;
+			ct = &fp->next;
+		}
+	*rt = NULL;
+	*ct = ref;
+	node->files = cand;
+}
+
+static void freeGroups(struct Node *node)
+{
+	struct group *g;
+	while ((g = node->groups) != NULL) {
+		node->groups = g->next;
+		free(g);
+	}
+}
+
+/* report one group of n duplicate files of bucket */
+static void emitGroup(struct finddups *ctx, struct Node *node, struct fe **files, int n)
+{
+	struct finddups_file *v;
+	struct group *g;
+	long size = node->size;
+	int k;
+	/* the whole-bucket paths group same-root files too */
+	if (!groupAllowed(ctx, files, n))
+		return;
+	/* only this bucket's compare thread touches its groups */
+	if (ctx->snapshotting || ctx->checkpointPath) {
+		g = Malloc(sizeof (struct group) + n * sizeof (struct fe *));
+		g->n = n;
+		memcpy(g->files, files, n * sizeof (struct fe *));
+		g->next = node->groups;
+		node->groups = g;
+	}
+	for (k = 0; ctx->newOnly && k < n && !files[k]->fresh; ++k);
+	if (k == n)
+		return;
+	STAT_ADD(ctx, ST_GROUPS, 1);
+	STAT_ADD(ctx, ST_DUPBYTES, (unsigned long long) size * (n - 1));
+	if (!ctx->onGroup)
+		return;
+	v = Malloc(n * sizeof (struct finddups_file));
+	for (k = 0; k < n; ++k) {
+		v[k].path = files[k]->name;
+		v[k].dev = files[k]->dev;
+		v[k].ino = files[k]->inode;
+	}
+	ctx->onGroup(ctx->onGroupArg, size, v, n);
+	free(v);
+}
+
+/* Snapshots, for rescanning a tree that has mostly not changed. Walks
+ * remember each directory by dev/inode with its mtime, its subdirectories
+ * and the regular files indexed from it, and runs remember each bucket by a
+ * hash of its members' dev/inode/mtime with the groups found in it. A later
+ * walk takes the files of a directory whose mtime is unchanged from the
+ * snapshot instead of reading and stat'ing them, and a bucket whose members
+ * hash the same gets its groups back without comparing. Writing a file in
+ * place changes no directory's mtime, so if its directory is reused the
+ * file keeps its old mtime, and its old result.
+ *
+ * The file is native-endian, meant to be read back on the host that wrote it:
+ *   "FDSNAP1\n"
+ *   'D' dev ino mtime nsubs nfiles, then nsubs names, then nfiles times
+ *       ino size mtime sparse name
+ *   'B' size hash ngroups, then for each group n and n indices into the
+ *       bucket's members sorted by dev/inode
+ * Names are NUL-terminated; sparse takes 1 byte, counts and indices 4, and
+ * the rest 8. Checkpoints use the same records, and also
+ *   'W' roots walked whole
+ *   'P' size hash cnt row col, then cnt indices giving the order of the
+ *       bucket's files, cnt flag bytes and (row + 1) * cnt 8-byte first
+ *       differences (see chkBucket), rows before row done and row itself
+ *       up to column col, then ngroups and groups as for 'B'
+ */
+#define SNAP_MAGIC "FDSNAP1\n"
+
+/* a directory as loaded from a snapshot (files points into the loaded file)
+ * or as walked (path set)
+ */
+struct snapDir {dev_t dev; ino_t ino; long long mtime; const char *subs; long nsubs;
+	const char *files; long nfiles; char *path; long seq; int stale; struct snapDir *next;};
+struct snapBucket {long size; unsigned long long hash; const char *groups; long ngroups;
+	int partial; long cnt, row, col; const char *order; struct snapBucket *next;};
+
+/* bounds-checked reading of a loaded snapshot */
+struct snapReader {const char *p, *end;};
+
+static int getBytes(struct snapReader *r, void *out, size_t n)
+{
+	if ((size_t) (r->end - r->p) < n)
+		return -1;
+	memcpy(out, r->p, n);
+	r->p += n;
+	return 0;
+}
+
+static unsigned long long get64(struct snapReader *r)
+{
+	unsigned long long v = 0;
+	if (getBytes(r, &v, 8))
+		r->p = NULL;
+	return v;
+}
+
+static unsigned get32(struct snapReader *r)
+{
+	unsigned v = 0;
+	if (getBytes(r, &v, 4))
+		r->p = NULL;
+	return v;
+}
+
+static const char *getStr(struct snapReader *r)
+{
+	const char *s = r->p, *z = memchr(s, '\0', r->end - s);
+	r->p = z ? z + 1 : NULL;
+	return s;
+}
+
+static long long mtimeOf(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static unsigned long snapSlot(dev_t dev, ino_t ino)
+{
+	return mix(mix(dev) ^ ino);
+}
+
+static struct snapDir *snapFindDir(struct finddups *ctx, dev_t dev, ino_t ino)
+{
+	struct snapDir *d;
+	if (!ctx->snapDirs)
+		return NULL;
+	for (d = ctx->snapDirs[snapSlot(dev, ino) & ctx->snapDirMask]; d; d = d->next)
+		if (d->dev == dev && d->ino == ino)
+			return d;
+	return NULL;
+}
+
+/* hash of a bucket's members, whatever their order; in cross-root mode,
+ * of their roots too, and of which are reference files, as those decide
+ * the groups
+ */
+static unsigned long long memberHash(struct finddups *ctx, struct Node *node)
+{
+	unsigned long long h = 0;
+	struct fe *f;
+	for (f = node->files; f; f = f->next)
+		h += mix(snapSlot(f->dev, f->inode) ^ f->mtime ^ (ctx->crossRoot ? mix(f->root + 2) : 0)
+				^ (f->ref ? 0x5265665265665265ULL : 0));
+	return h;
+}
+
+/* skip over one directory or bucket record; -1 if it runs off the end */
+static int snapSkip(struct snapReader *r, char tag, struct snapDir *d, struct snapBucket *b)
+{
+	size_t avail;
+	long k, n;
+	if (tag == 'D') {
+		d->dev = get64(r);
+		d->ino = get64(r);
+		d->mtime = get64(r);
+		d->nsubs = get32(r);
+		d->nfiles = get32(r);
+		d->subs = r->p;
+		for (k = 0; k < d->nsubs && r->p; ++k)
+			getStr(r);
+		d->files = r->p;
+		for (k = 0; k < d->nfiles && r->p; ++k) {
+			if (r->end - r->p < 25)
+				return -1;
+			r->p += 25;
+			getStr(r);
+		}
+	} else if (tag == 'B' || tag == 'P') {
+		b->size = get64(r);
+		b->hash = get64(r);
+		if ((b->partial = tag == 'P')) {
+			b->cnt = get32(r);
+			b->row = get32(r);
+			b->col = get32(r);
+			b->order = r->p;
+			avail = r->p ? r->end - r->p : 0;
+			if (!r->p || b->row >= b->cnt || b->col <= b->row || b->col > b->cnt
+					|| (size_t) b->cnt > avail / 5
+					|| (avail - 5 * b->cnt) / 8 / b->cnt < (size_t) b->row + 1)
+				return -1;
+			r->p += 5 * b->cnt + 8 * (b->row + 1) * b->cnt;
+		}
+		b->ngroups = get32(r);
+		b->groups = r->p;
+		for (k = 0; k < b->ngroups && r->p; ++k) {
+			n = get32(r);
+			if (!r->p || r->end - r->p < 4 * n)
+				return -1;
+			r->p += 4 * n;
+		}
+	} else {
+		return -1;
+	}
+	return r->p ? 0 : -1;
+}
+
+static void snapFree(struct finddups *ctx)
+{
+	long k;
+	free(ctx->snapBuf);
+	free(ctx->snapDirs);
+	free(ctx->snapBuckets);
+	free(ctx->snapDirPool);
+	free(ctx->snapBucketPool);
+	for (k = 0; k < ctx->nwalked; ++k) {
+		free(ctx->walked[k]->path);
+		free((char *) ctx->walked[k]->subs);
+		free(ctx->walked[k]);
+	}
+	free(ctx->walked);
+}
+
+/* file records of snapBuf in hash tables of directories and buckets */
+static int snapParse(struct finddups *ctx)
+{
+	struct snapReader r;
+	struct snapDir d, *dp;
+	struct snapBucket b, *bp;
+	long ndirs = 0, nbuckets = 0;
+	unsigned long size;
+	char tag;
+	int pass;
+
+	/* count records, then file them */
+	for (pass = 0; pass < 2; ++pass) {
+		r.p = ctx->snapBuf;
+		r.end = ctx->snapBuf + ctx->snapLen;
+		if (ctx->snapLen < 8 || memcmp(r.p, SNAP_MAGIC, 8))
+			goto bad;
+		r.p += 8;
+		while (r.p < r.end) {
+			tag = *r.p++;
+			if (tag == 'W') {
+				ctx->skipRoots = get32(&r);
+				if (!r.p)
+					goto bad;
+				continue;
+			}
+			if (snapSkip(&r, tag, &d, &b))
+				goto bad;
+			if (!pass) {
+				ndirs += tag == 'D';
+				nbuckets += tag != 'D';
+			} else if (tag == 'D') {
+				dp = &ctx->snapDirPool[ndirs++];
+				*dp = d;
+				dp->next = ctx->snapDirs[snapSlot(d.dev, d.ino) & ctx->snapDirMask];
+				ctx->snapDirs[snapSlot(d.dev, d.ino) & ctx->snapDirMask] = dp;
+			} else {
+				bp = &ctx->snapBucketPool[nbuckets++];
+				*bp = b;
+				bp->next = ctx->snapBuckets[mix(b.size) & ctx->snapBucketMask];
+				ctx->snapBuckets[mix(b.size) & ctx->snapBucketMask] = bp;
+			}
+		}
+		if (!pass) {
+			for (size = 64; size < (unsigned long) ndirs * 2; size *= 2);
+			ctx->snapDirMask = size - 1;
+			ctx->snapDirs = calloc(size, sizeof (struct snapDir *));
+			for (size = 64; size < (unsigned long) nbuckets * 2; size *= 2);
+			ctx->snapBucketMask = size - 1;
+			ctx->snapBuckets = calloc(size, sizeof (struct snapBucket *));
+			ctx->snapDirPool = malloc((ndirs + 1) * sizeof (struct snapDir));
+			ctx->snapBucketPool = malloc((nbuckets + 1) * sizeof (struct snapBucket));
+			if (!ctx->snapDirs || !ctx->snapBuckets || !ctx->snapDirPool || !ctx->snapBucketPool)
+				exit(2);
+			ndirs = nbuckets = 0;
+		}
+	}
+	return 0;
+bad:
+	free(ctx->snapBuf);
+	ctx->snapBuf = NULL;
+	errno = EINVAL;
+	return -1;
+}
+
+/* read snapshot into hash tables of directories and buckets */
+static int snapLoad(struct finddups *ctx, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if (ctx->snapBuf) {
+		errno = EBUSY;
+		return -1;
+	}
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) || !(ctx->snapBuf = malloc(st.st_size + 1))
+			|| read(fd, ctx->snapBuf, st.st_size) != st.st_size) {
+		free(ctx->snapBuf);
+		ctx->snapBuf = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	ctx->snapLen = st.st_size;
+	return snapParse(ctx);
+}
+
+/* remember a directory walked, for saving */
+static struct snapDir *snapWalked(struct finddups *ctx, const char *path, const struct stat *st)
+{
+	struct snapDir *d = Malloc(sizeof (struct snapDir));
+	memset(d, 0, sizeof *d);
+	d->dev = st->st_dev;
+	d->ino = st->st_ino;
+	d->mtime = mtimeOf(st);
+	d->path = copystr(path);
+	d->seq = ctx->nwalked;
+	if (ctx->nwalked == ctx->maxwalked) {
+		ctx->maxwalked = ctx->maxwalked ? ctx->maxwalked * 2 : 64;
+		if (!(ctx->walked = realloc(ctx->walked, ctx->maxwalked * sizeof (struct snapDir *))))
+			exit(2);
+	}
+	ctx->walked[ctx->nwalked++] = d;
+	return d;
+}
+
+/* a file of the directory named in name is being dropped from the index
+ * although it is still there (it could not be read), so the directory must
+ * be read again on the next walk with the snapshot
+ */
+static void snapStale(struct finddups *ctx, const char *name)
+{
+	const char *slash = strrchr(name, '/');
+	size_t len;
+	long k;
+	if (!slash)
+		return;
+	len = slash > name ? (size_t) (slash - name) : 1;
+	for (k = 0; k < ctx->nwalked; ++k)
+		if (!strncmp(ctx->walked[k]->path, name, len) && !ctx->walked[k]->path[len])
+			ctx->walked[k]->stale = 1;
+}
+
+/* walk directory at path, of len chars in a PATH_MAX buffer, taking its
+ * listing from the snapshot if unchanged since
+ */
+static void snapWalk(struct finddups *ctx, char *path, size_t len, const struct stat *st, int level)
+{
+	struct snapDir *old, *rec;
+	struct snapReader r;
+	struct FTW ftw;
+	struct stat sb;
+	struct dirent *de;
+	DIR *dir = NULL;
+	const char *name, *subs;
+	char *names = NULL;
+	size_t nlen = 0, nmax = 0, l;
+	long long m;
+	long k, nsubs = 0;
+
+	ftw.level = level;
+	ftw.base = strrchr(path, '/') ? strrchr(path, '/') - path + 1 : 0;
+	visit(path, st, FTW_D, &ftw);
+	old = snapFindDir(ctx, st->st_dev, st->st_ino);
+	if (!(old && old->mtime == mtimeOf(st)) && !(dir = opendir(path))) {
+		visit(path, st, FTW_DNR, &ftw);
+		return;
+	}
+	rec = snapWalked(ctx, path, st);
+	ftw.level = level + 1;
+	ftw.base = len + 1;
+	path[len] = '/';
+	if (!dir) {
+		STAT_ADD(ctx, ST_DIRS_REUSED, 1);
+		memset(&sb, 0, sizeof sb);
+		sb.st_mode = S_IFREG | 0444;
+		sb.st_nlink = 1;
+		sb.st_dev = st->st_dev;
+		r.p = old->files;
+		r.end = ctx->snapBuf + ctx->snapLen;
+		for (k = 0; k < old->nfiles; ++k) {
+			sb.st_ino = get64(&r);
+			sb.st_size = get64(&r);
+			m = get64(&r);
+			sb.st_mtim.tv_sec = m / 1000000000LL;
+			sb.st_mtim.tv_nsec = m % 1000000000LL;
+			sb.st_blocks = *r.p++ ? 0 : (sb.st_size + 511) / 512;
+			name = getStr(&r);
+			if (len + 1 + strlen(name) >= PATH_MAX)
+				continue;
+			strcpy(path + len + 1, name);
+			visit(path, &sb, FTW_F, &ftw);
+		}
+		subs = old->subs;
+		nsubs = old->nsubs;
+		for (k = 0; k < nsubs; ++k)
+			nlen += strlen(subs + nlen) + 1;
+	} else {
+		while ((de = readdir(dir)) != NULL) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			l = strlen(de->d_name);
+			if (len + 1 + l >= PATH_MAX) {
+				STAT_ADD(ctx, ST_ERRORS, 1);
+				continue;
+			}
+			strcpy(path + len + 1, de->d_name);
+			if (lstat(path, &sb)) {
+				visit(path, &sb, FTW_NS, &ftw);
+			} else if (S_ISREG(sb.st_mode)) {
+				visit(path, &sb, FTW_F, &ftw);
+			} else if (S_ISDIR(sb.st_mode)) {
+				if (nlen + l + 1 > nmax) {
+					nmax = (nlen + l + 1) * 2;
+					if (!(names = realloc(names, nmax)))
+						exit(2);
+				}
+				memcpy(names + nlen, de->d_name, l + 1);
+				nlen += l + 1;
+				++nsubs;
+			}
+		}
+		closedir(dir);
+		subs = names;
+	}
+	/* keep a copy, since old goes with the loaded snapshot */
+	rec->subs = subs = nsubs ? memcpy(Malloc(nlen), subs, nlen) : NULL;
+	rec->nsubs = nsubs;
+	free(names);
+	for (k = 0, name = subs; k < nsubs; ++k, name += strlen(name) + 1) {
+		if (len + 1 + strlen(name) >= PATH_MAX)
+			continue;
+		strcpy(path + len + 1, name);
+		if (!lstat(path, &sb) && S_ISDIR(sb.st_mode))
+			snapWalk(ctx, path, len + 1 + strlen(name), &sb, level + 1);
+	}
+	path[len] = '\0';
+}
+
+/* members of bucket sorted by dev/inode, the order groups are saved in */
+static int cmpDevIno(const void *a, const void *b)
+{
+	const struct fe *x = *(struct fe * const *) a, *y = *(struct fe * const *) b;
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	return x->inode < y->inode ? -1 : x->inode > y->inode;
+}
+
+static struct fe **sortedMembers(struct Node *node)
+{
+	struct fe **v = Malloc(node->c * sizeof (struct fe *)), *f;
+	long i = 0;
+	for (f = node->files; f; f = f->next)
+		v[i++] = f;
+	qsort(v, node->c, sizeof (struct fe *), cmpDevIno);
+	return v;
+}
+
+/* report the groups of bucket from the snapshot, if its members are the
+ * same as then; returns 0 if it has to be compared
+ */
+static int snapReplay(struct finddups *ctx, struct Node *node)
+{
+	struct snapBucket *b;
+	struct snapReader r;
+	struct fe **v, **grp, *f;
+	unsigned idx;
+	long g, k, n, i;
+
+	if (!ctx->snapBuckets)
+		return 0;
+	for (b = ctx->snapBuckets[mix(node->size) & ctx->snapBucketMask];
+			b && (b->size != node->size || b->partial); b = b->next);
+	if (!b || b->hash != memberHash(ctx, node))
+		return 0;
+	v = sortedMembers(node);
+	grp = Malloc(node->c * sizeof (struct fe *));
+	r.p = b->groups;
+	r.end = ctx->snapBuf + ctx->snapLen;
+	for (g = 0; g < b->ngroups; ++g) {
+		n = get32(&r);
+		for (k = i = 0; k < n; ++k)
+			if ((idx = get32(&r)) < (unsigned long) node->c && i < node->c)
+				grp[i++] = v[idx];
+		if (i >= 2)
+			emitGroup(ctx, node, grp, i);
+	}
+	for (f = node->files; f; f = f->next)
+		f->fresh = 0;
+	STAT_ADD(ctx, ST_BUCKETS_REUSED, 1);
+	free(grp);
+	free(v);
+	return 1;
+}
+
+static void put64(FILE *f, unsigned long long v)
+{
+	fwrite(&v, 8, 1, f);
+}
+
+static void put32(FILE *f, unsigned v)
+{
+	fwrite(&v, 4, 1, f);
+}
+
+/* latest walk of each directory first */
+static int cmpWalkedId(const void *a, const void *b)
+{
+	const struct snapDir *x = *(struct snapDir * const *) a, *y = *(struct snapDir * const *) b;
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return y->seq < x->seq ? -1 : y->seq > x->seq;
+}
+
+static int cmpWalkedPath(const void *a, const void *b)
+{
+	return strcmp((*(struct snapDir * const *) a)->path, (*(struct snapDir * const *) b)->path);
+}
+
+static void collectAll(struct Node *node, struct fe **v, long *n)
+{
+	struct fe *f;
+	if (!node)
+		return;
+	for (f = node->files; f; f = f->next)
+		v[(*n)++] = f;
+	collectAll(node->left, v, n);
+	collectAll(node->right, v, n);
+}
+
+static long countAll(struct Node *node)
+{
+	return node ? node->c + countAll(node->left) + countAll(node->right) : 0;
+}
+
+/* directory of dirs, sorted by path, that entry name is directly in; -1 if none */
+static long findDir(struct snapDir **dirs, long ndirs, const char *name)
+{
+	const char *slash = strrchr(name, '/');
+	size_t len;
+	long lo = 0, hi = ndirs, mid;
+	int c;
+	if (!slash)
+		return -1;
+	len = slash - name;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (!(c = strncmp(dirs[mid]->path, name, len)))
+			c = dirs[mid]->path[len] != '\0';
+		if (!c)
+			return mid;
+		if (c < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+static void snapSaveBuckets(struct finddups *ctx, FILE *f, struct Node *node)
+{
+	struct group *g;
+	struct fe **v, **p;
+	long ngroups = 0;
+	int k;
+	if (!node)
+		return;
+	if (node->c >= 2 && !node->dirty && !node->resolving) {
+		for (g = node->groups; g; g = g->next)
+			++ngroups;
+		v = sortedMembers(node);
+		fputc('B', f);
+		put64(f, node->size);
+		put64(f, memberHash(ctx, node));
+		put32(f, ngroups);
+		for (g = node->groups; g; g = g->next) {
+			put32(f, g->n);
+			for (k = 0; k < g->n; ++k) {
+				p = bsearch(&g->files[k], v, node->c, sizeof (struct fe *), cmpDevIno);
+				put32(f, p - v);
+			}
+		}
+		free(v);
+	}
+	snapSaveBuckets(ctx, f, node->left);
+	snapSaveBuckets(ctx, f, node->right);
+}
+
+static void freePartial(struct partial *p)
+{
+	if (!p)
+		return;
+	free(p->order);
+	free(p->flags);
+	free(p->ar);
+	free(p->groups);
+	free(p);
+}
+
+/* record for checkpoints that the first row rows of bucket are done, and
+ * row itself up to column col, with first differences in ar and files
+ * already grouped flagged
+ */
+static void publishPartial(struct finddups *ctx, struct Node *node, long row, long col, int cnt,
+		int *flags, long *ar)
+{
+	struct partial *p = Malloc(sizeof (struct partial)), *old;
+	struct group *g;
+	struct fe *f;
+	int k;
+	p->row = row;
+	p->col = col;
+	p->cnt = cnt;
+	p->order = Malloc(cnt * sizeof (struct fe *));
+	for (k = 0, f = node->files; f; f = f->next)
+		p->order[k++] = f;
+	p->flags = memcpy(Malloc(cnt * sizeof (int)), flags, cnt * sizeof (int));
+	p->ar = memcpy(Malloc((row + 1) * cnt * sizeof (long)), ar, (row + 1) * cnt * sizeof (long));
+	for (p->ngroups = 0, g = node->groups; g; g = g->next)
+		++p->ngroups;
+	p->groups = Malloc(p->ngroups * sizeof (struct group *) + 1);
+	for (k = 0, g = node->groups; g; g = g->next)
+		p->groups[k++] = g;
+	pthread_mutex_lock(&ctx->schedLock);
+	old = node->partial;
+	node->partial = p;
+	pthread_mutex_unlock(&ctx->schedLock);
+	freePartial(old);
+}
+
+/* progress a checkpoint recorded for node, if it still fits its files */
+static struct snapBucket *findPartial(struct finddups *ctx, struct Node *node)
+{
+	struct snapBucket *b;
+	if (!ctx->snapBuckets)
+		return NULL;
+	for (b = ctx->snapBuckets[mix(node->size) & ctx->snapBucketMask];
+			b && (b->size != node->size || !b->partial); b = b->next);
+	return b && b->cnt == node->c && b->hash == memberHash(ctx, node) ? b : NULL;
+}
+
+/* put the files of bucket back in the order that the rows a checkpoint
+ * left it at refer to. This relinks the list, so it is done before compare
+ * workers start and checkpoints can walk the index.
+ */
+static void resumeOrder(struct finddups *ctx, struct Node *node)
+{
+	struct snapBucket *b = findPartial(ctx, node);
+	struct snapReader r;
+	struct fe **v, **order;
+	unsigned idx;
+	long k;
+
+	if (!b)
+		return;
+	v = sortedMembers(node);
+	order = Malloc(b->cnt * sizeof (struct fe *));
+	r.p = b->order;
+	r.end = ctx->snapBuf + ctx->snapLen;
+	for (k = 0; k < b->cnt; ++k) {
+		if ((idx = get32(&r)) >= (unsigned) b->cnt) {
+			b->cnt = -1;      /* unusable; resumePartial skips it */
+			free(order);
+			free(v);
+			return;
+		}
+		order[k] = v[idx];
+	}
+	for (k = 0; k < b->cnt - 1; ++k)
+		order[k]->next = order[k+1];
+	order[k]->next = NULL;
+	node->files = order[0];
+	free(order);
+	free(v);
+}
+
+/* pick up bucket where a checkpoint left it, its files already in order
+ * (resumeOrder): restore flags and first differences, and report groups
+ * found so far. Returns the row to go on from, 0 if there is none, and
+ * sets col to the column in it.
+ */
+static long resumePartial(struct finddups *ctx, struct Node *node, int cnt, int *flags, long *ar, long *col)
+{
+	struct snapBucket *b = findPartial(ctx, node);
+	struct snapReader r;
+	struct fe **v, **grp;
+	unsigned idx;
+	long g, ng, k, n, i;
+	long long d = -1;
+
+	if (!b || b->cnt != cnt)
+		return 0;
+	v = sortedMembers(node);
+	grp = Malloc(cnt * sizeof (struct fe *));
+	r.p = b->order + 4 * cnt;
+	r.end = ctx->snapBuf + ctx->snapLen;
+	for (k = 0; k < cnt; ++k)
+		flags[k] = *r.p++;
+	for (k = 0; k < (b->row + 1) * cnt; ++k) {
+		getBytes(&r, &d, 8);
+		ar[k] = d;
+	}
+	*col = b->col;
+	for (g = 0, ng = get32(&r); g < ng; ++g) {
+		for (k = i = 0, n = get32(&r); k < n; ++k)
+			if ((idx = get32(&r)) < (unsigned) cnt)
+				grp[i++] = v[idx];
+		if (i >= 2)
+			emitGroup(ctx, node, grp, i);
+	}
+	free(grp);
+	free(v);
+	return b->row;
+}
+
+/* progress of buckets being compared; must hold schedLock */
+static void savePartials(struct finddups *ctx, FILE *f, struct Node *node)
+{
+	struct partial *p;
+	struct fe **v, **q;
+	long k;
+	int j;
+	if (!node)
+		return;
+	if ((p = node->partial) != NULL) {
+		v = sortedMembers(node);
+		fputc('P', f);
+		put64(f, node->size);
+		put64(f, memberHash(ctx, node));
+		put32(f, p->cnt);
+		put32(f, p->row);
+		put32(f, p->col);
+		for (k = 0; k < p->cnt; ++k) {
+			q = bsearch(&p->order[k], v, node->c, sizeof (struct fe *), cmpDevIno);
+			put32(f, q - v);
+		}
+		for (k = 0; k < p->cnt; ++k)
+			fputc(p->flags[k], f);
+		for (k = 0; k < (p->row + 1) * p->cnt; ++k)
+			put64(f, p->ar[k]);
+		put32(f, p->ngroups);
+		for (k = 0; k < p->ngroups; ++k) {
+			put32(f, p->groups[k]->n);
+			for (j = 0; j < p->groups[k]->n; ++j) {
+				q = bsearch(&p->groups[k]->files[j], v, node->c, sizeof (struct fe *), cmpDevIno);
+				put32(f, q - v);
+			}
+		}
+		free(v);
+	}
+	savePartials(ctx, f, node->left);
+	savePartials(ctx, f, node->right);
+}
+
+static int snapSave(struct finddups *ctx, const char *path)
+{
+	struct snapDir **dirs, *d;
+	struct fe **all, **byDir;
+	const char *s;
+	char *tmp;
+	long *owner, *start, ndirs, nall = 0, i, k, n;
+	FILE *f;
+	int bad;
+
+	tmp = Malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	if (!(f = fopen(tmp, "w"))) {
+		free(tmp);
+		return -1;
+	}
+	fwrite(SNAP_MAGIC, 1, 8, f);
+
+	/* latest walk of each directory, with the files now indexed in it */
+	dirs = Malloc((ctx->nwalked + 1) * sizeof (struct snapDir *));
+	memcpy(dirs, ctx->walked, ctx->nwalked * sizeof (struct snapDir *));
+	qsort(dirs, ctx->nwalked, sizeof (struct snapDir *), cmpWalkedId);
+	for (i = ndirs = 0; i < ctx->nwalked; ++i)
+		if (!ndirs || dirs[i]->dev != dirs[ndirs-1]->dev || dirs[i]->ino != dirs[ndirs-1]->ino)
+			dirs[ndirs++] = dirs[i];
+	qsort(dirs, ndirs, sizeof (struct snapDir *), cmpWalkedPath);
+	all = Malloc((countAll(ctx->root) + 1) * sizeof (struct fe *));
+	collectAll(ctx->root, all, &nall);
+	owner = Malloc((nall + 1) * sizeof (long));
+	start = calloc(ndirs + 2, sizeof (long));
+	for (i = 0; i < nall; ++i)
+		if ((owner[i] = findDir(dirs, ndirs, all[i]->name)) >= 0)
+			++start[owner[i] + 2];
+	for (k = 0; k < ndirs; ++k)
+		start[k+2] += start[k+1];
+	/* order entries by directory; those in no walked directory drop out */
+	byDir = Malloc((nall + 1) * sizeof (struct fe *));
+	for (i = 0; i < nall; ++i)
+		if (owner[i] >= 0)
+			byDir[start[owner[i] + 1]++] = all[i];
+	for (k = 0; k < ndirs; ++k) {
+		d = dirs[k];
+		n = start[k+1] - start[k];
+		/* a file on another device than its directory can't be reused */
+		for (i = start[k], bad = 0; i < start[k+1]; ++i)
+			bad |= byDir[i]->dev != d->dev;
+		fputc('D', f);
+		put64(f, d->dev);
+		put64(f, d->ino);
+		put64(f, bad || d->stale ? -1 : d->mtime);
+		put32(f, d->nsubs);
+		put32(f, n);
+		for (i = 0, s = d->subs; i < d->nsubs; ++i, s += strlen(s) + 1)
+			fwrite(s, 1, strlen(s) + 1, f);
+		for (i = start[k]; i < start[k+1]; ++i) {
+			put64(f, byDir[i]->inode);
+			put64(f, byDir[i]->size);
+			put64(f, byDir[i]->mtime);
+			fputc(byDir[i]->sparse, f);
+			s = strrchr(byDir[i]->name, '/') + 1;
+			fwrite(s, 1, strlen(s) + 1, f);
+		}
+	}
+	free(byDir);
+	free(start);
+	free(owner);
+	free(all);
+	free(dirs);
+
+	/* buckets compared since they last changed */
+	snapSaveBuckets(ctx, f, ctx->root);
+	if (ferror(f) | fclose(f) || rename(tmp, path)) {
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* walk root, using and recording snapshot */
+static int snapRoot(struct finddups *ctx, const char *root)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct FTW ftw;
+	size_t len = strlen(root);
+	while (len > 1 && root[len-1] == '/')
+		--len;
+	if (len >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(path, root, len);
+	path[len] = '\0';
+	if (lstat(path, &st))
+		return -1;
+	if (S_ISDIR(st.st_mode)) {
+		snapWalk(ctx, path, len, &st, 0);
+	} else if (S_ISREG(st.st_mode)) {
+		ftw.base = strrchr(path, '/') ? strrchr(path, '/') - path + 1 : 0;
+		ftw.level = 0;
+		visit(path, &st, FTW_F, &ftw);
+	}
+	return 0;
+}
+
+/* Per-file errors. A file that cannot be opened or read while comparing is
+ * reported through the error callback and left out of the rest of its
+ * bucket's comparison; what it was found to match or differ from before
+ * still stands. Once the run ends it is dropped from the index.
+ */
+static void fileError(struct finddups *ctx, struct fe *f, int err)
+{
+	DEBUG_PRINT("Cannot read %s: %s\n", f->name, strerror(err));
+	STAT_ADD(ctx, ST_ERRORS, 1);
+	pthread_mutex_lock(&ctx->failLock);
+	if (!f->failed) {
+		f->failed = err ? err : EIO;
+		if (ctx->nfailed == ctx->maxfailed) {
+			ctx->maxfailed = ctx->maxfailed ? ctx->maxfailed * 2 : 16;
+			if (!(ctx->failed = realloc(ctx->failed, ctx->maxfailed * sizeof (struct fe *))))
+				exit(2);
+		}
+		ctx->failed[ctx->nfailed++] = f;
+	}
+	pthread_mutex_unlock(&ctx->failLock);
+	if (ctx->onError)
+		ctx->onError(ctx->onErrorArg, f->name, err);
+}
+
+/* current extent of a file being compared; [pos, end) is all hole or all data */
+struct extent {int fd; int sparse; off_t size, end; int hole;};
+
+/* find extent containing pos, using SEEK_DATA/SEEK_HOLE for sparse files.
+ * Filesystems without hole reporting just look like one big data extent.
+ */
+static void findExtent(struct extent *e, off_t pos)
+{
+	off_t d, h;
+	e->hole = 0;
+	e->end = e->size;
+#ifdef SEEK_DATA
+	if (!e->sparse)
+		return;
+	d = lseek(e->fd, pos, SEEK_DATA);
+	if (d < 0) {
+		/* ENXIO means only a hole remains before EOF */
+		if (errno == ENXIO)
+			e->hole = 1;
+		return;
+	}
+	if (d > pos) {
+		e->hole = 1;
+		e->end = d < e->size ? d : e->size;
+		return;
+	}
+	h = lseek(e->fd, pos, SEEK_HOLE);
+	if (h > pos && h < e->size)
+		e->end = h;
+#endif
+}
+
+/* return index of first byte that differs between a and b, or n if none do */
+static size_t firstDiff(const char *a, const char *b, size_t n)
+{
+	size_t k;
+#if defined(FINDDUPS_BENCH)
+	if (benchKernel)
+		return benchKernel(a, b, n);
+#endif
+	if (!memcmp(a, b, n))
+		return n;
+	for (k = 0; a[k] == b[k]; ++k);
+	return k;
+}
+
+/* return index of first non-zero byte in a, or n if all are zero */
+static size_t firstNonZero(const char *a, size_t n)
+{
+	size_t k;
+	for (k = 0; k < n && !a[k]; ++k);
+	return k;
+}
+
+/* compare two files of the given size, starting at offset skip (everything
+ * before skip is already known to match).
+ * Returns offset of the first differing byte, or size if files are identical,
+ * or FAILED_I or FAILED_J with errno set if fi or fj cannot be read.
+ * Ranges that are holes in both files compare equal without any reads;
+ * where only one file has a hole, just the other file's data is read and
+ * checked for zeros.
+ */
+#define FAILED_I -2
+#define FAILED_J -3
+
+static long cmpFiles(struct finddups *ctx, struct fe *fi, struct fe *fj, long size, long skip, char *ibuff, char *jbuff)
+{
+	struct extent ei, ej;
+	off_t pos, end;
+	struct ioReq req[2];
+	const char *ip, *jp;
+	ssize_t nri, nrj;
+	size_t len, k;
+	int nreq, ri, rj, err;
+
+	/* TODO  optimize open/closing of fi, maybe use a rewind */
+	if ((ei.fd = openFile(ctx, fi->name)) < 0)
+		return FAILED_I;
+	if ((ej.fd = openFile(ctx, fj->name)) < 0) {
+		err = errno;
+		closeFile(ctx, ei.fd);
+		errno = err;
+		return FAILED_J;
+	}
+
+	if (skip > 0)
+		DEBUG_PRINT("Skipping ahead %ld in %s and %s because of prefix inferences\n",
+				skip, fi->name, fj->name);
+
+	/* holes can only be found through real file descriptors */
+	ei.sparse = fi->sparse && ctx->io->realFds;
+	ej.sparse = fj->sparse && ctx->io->realFds;
+	ei.size = ej.size = size;
+	ei.end = ej.end = 0;
+	for (pos = skip; pos < size; pos += len) {
+		if (pos >= ei.end)
+			findExtent(&ei, pos);
+		if (pos >= ej.end)
+			findExtent(&ej, pos);
+		end = ei.end < ej.end ? ei.end : ej.end;
+		len = end - pos < BUFSIZE ? end - pos : BUFSIZE;
+
+		if (ei.hole && ej.hole) {
+			/* both zero-filled, nothing to read */
+			len = end - pos;
+			continue;
+		}
+		/* use the backend's own copy of the data where it has one, and
+		 * read both sides together otherwise
+		 */
+		nreq = 0;
+		ri = rj = -1;
+		ip = ei.hole ? ibuff : viewAt(ctx, ei.fd, pos, len);
+		jp = ej.hole ? jbuff : viewAt(ctx, ej.fd, pos, len);
+		if (!ip) {
+			ip = ibuff;
+			req[ri = nreq++] = (struct ioReq) {ei.fd, ibuff, len, pos, 0};
+		}
+		if (!jp) {
+			jp = jbuff;
+			req[rj = nreq++] = (struct ioReq) {ej.fd, jbuff, len, pos, 0};
+		}
+		if (nreq)
+			readBatch(ctx, req, nreq);
+		nri = ri < 0 ? (ssize_t) len : req[ri].res;
+		nrj = rj < 0 ? (ssize_t) len : req[rj].res;
+		if (nri < 0 || nrj < 0) {
+			err = nri < 0 ? req[ri].err : req[rj].err;
+			closeFile(ctx, ej.fd);
+			closeFile(ctx, ei.fd);
+			errno = err;
+			return nri < 0 ? FAILED_I : FAILED_J;
+		}
+
+		/* file shrank under us; treat as a difference at the short end */
+		if (nri != nrj || (size_t) nri != len) {
+			pos += nri < nrj ? nri : nrj;
+			break;
+		}
+
+		if (ei.hole)
+			k = firstNonZero(jp, len);
+		else if (ej.hole)
+			k = firstNonZero(ip, len);
+		else
+			k = firstDiff(ip, jp, len);
+		if (k < len) {
+			pos += k;
+			break;
+		}
+	}
+	closeFile(ctx, ej.fd);
+	closeFile(ctx, ei.fd);
+	return pos < size ? pos : size;
+}
+
+/* device properties, looked up once per st_dev */
+struct devInfo {
+	dev_t dev;
+	int rotational, depth, busy;  /* depth: max buckets in flight on device */
+	struct Node **q;              /* buckets queued on device, taken from qhead */
+	long qhead, qlen, qmax;
+	struct devInfo *next;
+};
+
+/* read /sys flag for device, trying partition's parent device if needed.
+ * Returns -1 if unknown.
+ */
+static int readRotational(dev_t dev)
+{
+	char path[128];
+	FILE *f;
+	int r = -1;
+	snprintf(path, sizeof path, "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+	if ((f = fopen(path, "r")) == NULL) {
+		snprintf(path, sizeof path, "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+		f = fopen(path, "r");
+	}
+	if (f) {
+		if (fscanf(f, "%d", &r) != 1)
+			r = -1;
+		fclose(f);
+	}
+	return r;
+}
+
+static struct devInfo *getDevice(struct finddups *ctx, dev_t dev)
+{
+	struct devInfo *d;
+	for (d = ctx->devices; d; d = d->next)
+		if (d->dev == dev)
+			return d;
+	d = Malloc(sizeof (struct devInfo));
+	memset(d, 0, sizeof (struct devInfo));
+	d->dev = dev;
+	d->rotational = readRotational(dev) == 1;
+	DEBUG_PRINT("device %u:%u rotational = %d\n", major(dev), minor(dev), d->rotational);
+	d->next = ctx->devices;
+	ctx->devices = d;
+	return d;
+}
+
+/* find physical address of start of file, via FIEMAP; fall back to inode
+ * number, which on most filesystems roughly tracks on-disk placement
+ */
+static unsigned long long physLoc(struct finddups *ctx, struct fe *f)
+{
+	struct {struct fiemap fm; struct fiemap_extent ext[1];} fmb;
+	unsigned long long retval = f->inode;
+	int fd;
+	if (!ctx->io->realFds || (fd = openFile(ctx, f->name)) < 0)
+		return retval;
+	memset(&fmb, 0, sizeof fmb);
+	fmb.fm.fm_length = FIEMAP_MAX_OFFSET;
+	fmb.fm.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fmb.fm) == 0 && fmb.fm.fm_mapped_extents > 0)
+		retval = fmb.ext[0].fe_physical;
+	closeFile(ctx, fd);
+	return retval;
+}
+
+static int cmpLoc(const void *a, const void *b)
+{
+	unsigned long long la = (*(struct fe * const *) a)->loc, lb = (*(struct fe * const *) b)->loc;
+	return la < lb ? -1 : la > lb;
+}
+
+static int cmpBucketLoc(const void *a, const void *b)
+{
+	unsigned long long la = (*(struct Node * const *) a)->files->loc;
+	unsigned long long lb = (*(struct Node * const *) b)->files->loc;
+	return la < lb ? -1 : la > lb;
+}
+
+/* look up physical location of every file in bucket, then relink files in
+ * ascending order of location so pairwise reads sweep across the disk.
+ * Locations are looked up once; loc is 0 until then.
+ */
+static void sortByLoc(struct finddups *ctx, struct Node *node)
+{
+	struct fe **v, *fp;
+	long i;
+	v = Malloc(node->c * sizeof (struct fe *));
+	for (i = 0, fp = node->files; fp; fp = fp->next) {
+		if (!fp->loc)
+			fp->loc = physLoc(ctx, fp);
+		v[i++] = fp;
+	}
+	qsort(v, node->c, sizeof (struct fe *), cmpLoc);
+	for (i = 0; i < node->c - 1; ++i)
+		v[i]->next = v[i+1];
+	v[i]->next = NULL;
+	node->files = v[0];
+	free(v);
+}
+
+/* walk tree in ascending size order, collecting buckets that have at least
+ * two files and changed since last compared
+ */
+static void collectBuckets(struct finddups *ctx, struct Node *node)
+{
+	if (!node)
+		return;
+	collectBuckets(ctx, node->left);
+	if (node->dirty && node->c >= 2) {
+		if (ctx->nbuckets == ctx->maxbuckets) {
+			ctx->maxbuckets = ctx->maxbuckets ? ctx->maxbuckets * 2 : 64;
+			ctx->buckets = realloc(ctx->buckets, ctx->maxbuckets * sizeof (struct Node *));
+			if (!ctx->buckets)
+				exit(2);
+		}
+		ctx->buckets[ctx->nbuckets++] = node;
+	}
+	node->dirty = 0;
+	collectBuckets(ctx, node->right);
+}
+
+static void freeTree(struct Node *node)
+{
+	if (!node)
+		return;
+	freeTree(node->left);
+	freeTree(node->right);
+	freeFiles(node->files);
+	freeGroups(node);
+	free(node);
+}
+
+/* how many files of a small bucket are opened ahead of reading them */
+#define SMALL_BATCH 64
+
+static int cmpContents(const void *a, const void *b, void *size)
+{
+	return memcmp(*(char * const *) a, *(char * const *) b, *(long *) size);
+}
+
+/* read rest of file into buf, the first got bytes of which are already
+ * there; returns 0 on success, -1 if it has since changed size, -2 if it
+ * cannot be read
+ */
+static int readWhole(struct finddups *ctx, int fd, char *buf, long size, long got)
+{
+	ssize_t nr;
+	for (; got < size; got += nr) {
+		if ((nr = readAt(ctx, fd, buf + got, size - got, got)) < 0)
+			return -2;
+		if (!nr)
+			return -1;
+	}
+	return 0;
+}
+
+/* check bucket of small files by reading each one once into a contiguous
+ * buffer, sorting the contents and picking out runs of equal ones.
+ * Files are opened a batch at a time with readahead requested for the whole
+ * batch, so the kernel can fetch them while earlier ones are copied.
+ */
+static void chkSmallBucket(struct finddups *ctx, struct Node *node, int cnt)
+{
+	struct fe **files, **grp, *fp;
+	char *data, **slots;
+	struct ioReq reqs[SMALL_BATCH];
+	int which[SMALL_BATCH];
+	int i, j, k, m, n, r, nslots, err;
+	long size = node->size;
+
+	data = Malloc(size * cnt);
+	files = Malloc(cnt * sizeof (struct fe *));
+	slots = Malloc(cnt * sizeof (char *));
+	grp = Malloc(cnt * sizeof (struct fe *));
+	for (i = 0, fp = node->files; fp; fp = fp->next)
+		files[i++] = fp;
+
+	for (i = nslots = 0; i < cnt; i += n) {
+		n = cnt - i < SMALL_BATCH ? cnt - i : SMALL_BATCH;
+		for (k = m = 0; k < n; ++k) {
+			if ((reqs[m].h = openFile(ctx, files[i+k]->name)) < 0) {
+				fileError(ctx, files[i+k], errno);
+				continue;
+			}
+			reqs[m].buf = data + (long) (i+k) * size;
+			reqs[m].n = size;
+			reqs[m].pos = 0;
+			if (ctx->io->realFds)
+				posix_fadvise(reqs[m].h, 0, size, POSIX_FADV_WILLNEED);
+			which[m++] = i + k;
+		}
+		readBatch(ctx, reqs, m);
+		for (k = 0; k < m; ++k) {
+			if (reqs[k].res < 0) {
+				r = -2;
+				err = reqs[k].err;
+			} else if ((r = readWhole(ctx, reqs[k].h, reqs[k].buf, size, reqs[k].res)) == -2) {
+				err = errno;
+			}
+			if (r == -2)
+				fileError(ctx, files[which[k]], err);
+			else if (!r)
+				slots[nslots++] = reqs[k].buf;
+			closeFile(ctx, reqs[k].h);
+		}
+	}
+
+	qsort_r(slots, nslots, sizeof (char *), cmpContents, &size);
+
+	for (i = 0; i < nslots; i = j) {
+		for (j = i + 1; j < nslots && !memcmp(slots[i], slots[j], size); ++j);
+		if (j - i < 2)
+			continue;
+		for (k = i; k < j; ++k)
+			grp[k - i] = files[(slots[k] - data) / size];
+		emitGroup(ctx, node, grp, j - i);
+	}
+
+	free(grp);
+	free(slots);
+	free(files);
+	free(data);
+}
+
+/* Look in past rows of ar at column values for i & j.
+ * If any rows have diff. values for these, we infer they don't match: -1.
+ * Otherwise, return max value for these in the prev. rows.
+ * We know that these many bytes of the 2 files are identical, so
+ * we can skip those.
+ */
+static long knownSame(long *ar, int cnt, int i, int j)
+{
+	long ari, arj, maxToSkip = 0;
+	int pr;
+	for (pr = 0; pr < i; ++pr) {
+		ari = ar[pr*cnt + i];
+		arj = ar[pr*cnt + j];
+		/* DEBUG_PRINT("ar[%d] = %ld, ar[%d] = %ld\n", pr*cnt + i, ari, pr*cnt + j, arj); */
+		if (ari < 0 || arj < 0)
+			continue;     /* pair never compared, nothing to infer */
+		if (ari != arj)
+			return -1;
+		if (ari > maxToSkip)
+			maxToSkip = ari;
+	}
+	return maxToSkip;
+}
+
+/* compare a and b past the first skip bytes, counting and tracing the
+ * pair; returns as cmpFiles
+ */
+static long comparePair(struct finddups *ctx, struct fe *a, struct fe *b, long size, long skip,
+		char *ibuff, char *jbuff)
+{
+	double start = traceFile ? wallNow() : 0;
+	long r;
+	STAT_ADD(ctx, ST_PAIRS, 1);
+	STAT_ADD(ctx, ST_SKIPPED, skip);
+	r = cmpFiles(ctx, a, b, size, skip, ibuff, jbuff);
+	if (traceFile && r >= 0) {
+		traceBegin("compare", "pair", start);
+		traceArgStr("a", a->name);
+		traceArgStr("b", b->name);
+		traceArgNum("skipped", skip);
+		traceArgNum("differ_at", r);
+		traceEnd();
+	}
+	return r;
+}
+
+/* check one bucket of same-size files for duplicates, emitting each group
+ * as soon as it is complete. The bucket and its entries stay in the index,
+ * with fresh cleared, for later runs.
+ */
+static void chkBucket(struct finddups *ctx, struct Node *node) {
+	int cnt, i, j, k, m, *fflags, *deferred, nd, ng, lastCand;
+	struct fe *fp, *fi, *fj, **grp, **files;
+	long *ar, maxToSkip, row, col = 0;
+	char *ibuff, *jbuff;
+	double start = traceFile ? wallNow() : 0;
+	double published = ctx->checkpointPath ? wallNow() : 0;
+	unsigned long long credited = 0;
+
+	/* DEBUG_PRINT("Checking dups of size %ld\n", node->size); */
+	for (cnt=0, fp = node->files; fp != NULL; fp = fp->next, ++cnt);
+	STAT_ADD(ctx, ST_BUCKETS, 1);
+	grp = Malloc(cnt * sizeof (struct fe *));
+
+	/* TODO If general case handles size == 0 case efficiently, get rid
+	 *     of this special case
+	 */
+	if (node->size && (unsigned long) node->size * cnt <= ctx->smallBudget) {
+		chkSmallBucket(ctx, node, cnt);
+	} else if (node->size) {
+		ibuff = Malloc(BUFSIZE);
+		jbuff = Malloc(BUFSIZE);
+		fflags = calloc(cnt, sizeof(int));
+		/* pairs not allowed in row i */
+		deferred = Malloc(cnt * sizeof (int));
+		files = Malloc(cnt * sizeof (struct fe *));
+		/* General case, two or more non-empty files.
+		 * allocate N x N array for bookkeeping to keep track of the
+		 * offset where files A and B first differ; -1 if not known
+		 */
+		ar = Malloc(cnt * cnt * sizeof(long));
+		for (i = 0; i < cnt * cnt; ++i)
+			ar[i] = -1;
+		/* a resumed run goes on from where the last checkpoint was */
+		row = resumePartial(ctx, node, cnt, fflags, ar, &col);
+		for (i = 0, lastCand = -1, fp = node->files; fp; fp = fp->next, ++i) {
+			files[i] = fp;
+			if (!fp->ref)
+				lastCand = i;
+		}
+		for (i = 0, fi = node->files; i < row; ++i, fi = fi->next);
+		/* past the last candidate, all pairs are of reference files */
+		for (; i < cnt - 1 && i <= lastCand; ++i, fi = fi->next) {
+			/* DEBUG_PRINT("i = %d, file = %s, fflags[i] = %d\n", i, fi->name, fflags[i]); */
+			if (i) {
+				/* row i-1 is done, so its file is resolved */
+				PROGRESS_ADD(ctx, bytesDone, node->size);
+				credited += node->size;
+			}
+			if (ctx->checkpointPath && wallNow() - published >= ctx->checkpointInterval) {
+				publishPartial(ctx, node, i, i + 1, cnt, fflags, ar);
+				published = wallNow();
+			}
+
+			ng = nd = 0;
+			j = i + 1;
+			if (i == row && col > j) {
+				/* resumed partway through the row: take back what
+				 * the columns done had found
+				 */
+				for (; j < col; ++j)
+					if (ar[i*cnt + j] == node->size) {
+						if (!ng)
+							grp[ng++] = fi;
+						grp[ng++] = files[j];
+					} else if (!fflags[j] && !pairAllowed(ctx, fi, files[j])) {
+						deferred[nd++] = j;
+					}
+			} else if (fflags[i]) {
+				continue;      /* i already output as a dup */
+			}
+
+			for (; j < cnt; ++j) {
+				fj = files[j];
+				/* DEBUG_PRINT("j = %d, file = %s, fflags[j] = %d\n", j, fj->name, fflags[j]); */
+				if (fflags[j])
+					continue;  /* j already output as a dup */
+
+				if (!pairAllowed(ctx, fi, fj)) {
+					deferred[nd++] = j;
+					continue;
+				}
+
+				maxToSkip = knownSame(ar, cnt, i, j);
+				/* DEBUG_PRINT("maxToSkip = %ld\n", maxToSkip); */
+
+				if (maxToSkip < 0) {
+					DEBUG_PRINT("Skipping comparison of %s and %s because of prefix length diff\n",
+							fi->name, fj->name);
+					STAT_ADD(ctx, ST_INFERRED, 1);
+					continue;         /* inferred these differ due to prefix length differences */
+				}
+
+				if (fi->hashed && fj->hashed && fi->phash != fj->phash) {
+					DEBUG_PRINT("Skipping comparison of %s and %s because of prefix hash diff\n",
+							fi->name, fj->name);
+					STAT_ADD(ctx, ST_HASHED, 1);
+					continue;
+				}
+
+				/* both matched the file of an earlier row, which then
+				 * failed before it could report them together
+				 */
+				if (maxToSkip == node->size)
+					ar[i*cnt + j] = node->size;
+				else
+					ar[i*cnt + j] = comparePair(ctx, fi, fj, node->size, maxToSkip, ibuff, jbuff);
+				if (ar[i*cnt + j] == FAILED_J) {
+					/* leave fj out of the rest of the bucket */
+					fileError(ctx, fj, errno);
+					ar[i*cnt + j] = -1;
+					fflags[j] = 1;
+					continue;
+				}
+				if (ar[i*cnt + j] == FAILED_I) {
+					/* nothing more to compare fi with */
+					fileError(ctx, fi, errno);
+					ar[i*cnt + j] = -1;
+					break;
+				}
+				/* DEBUG_PRINT("ar[%d] = %ld\n", i*cnt + j, ar[i*cnt + j]); */
+
+				/* if we've matched through end of file, these are dups */
+				if (ar[i*cnt + j] == node->size) {
+					/* DEBUG_PRINT("We found dups!\n"); */
+					/* make sure we only add fi once */
+					if (! fflags[i])
+						grp[ng++] = fi;
+					grp[ng++] = fj;
+					fflags[i] = fflags[j] = 1;
+					/* DEBUG_PRINT("setting fflags[%d] and fflags[%d]\n", i, j); */
+				}
+
+				/* pairs can take long, so checkpoints go to the column */
+				if (ctx->checkpointPath && wallNow() - published >= ctx->checkpointInterval) {
+					publishPartial(ctx, node, i, j + 1, cnt, fflags, ar);
+					published = wallNow();
+				}
+			}
+
+			/* Files matching fi before it failed have not been
+			 * compared with the rest of the row, so they go back to
+			 * be compared in rows of their own. What row i found
+			 * stays in ar, so matches of fi need not be read again.
+			 */
+			if (fi->failed) {
+				for (j = i + 1; j < cnt; ++j)
+					if (ar[i*cnt + j] == node->size)
+						fflags[j] = 0;
+				ng = 0;
+			}
+
+			/* A pair fi may not be compared as is still needs settling
+			 * when fi has matches: compare it with a match it may be
+			 * compared with instead. The match has fi's content, so the
+			 * result stands for fi in ar and in inferences from it.
+			 */
+			for (k = 0; k < nd && ng; ++k) {
+				j = deferred[k];
+				if (fflags[j])
+					continue;
+				for (m = 1; m < ng && !pairAllowed(ctx, grp[m], files[j]); ++m);
+				if (m == ng)
+					continue;
+				if ((maxToSkip = knownSame(ar, cnt, i, j)) < 0) {
+					STAT_ADD(ctx, ST_INFERRED, 1);
+					continue;
+				}
+				if (fi->hashed && files[j]->hashed && fi->phash != files[j]->phash) {
+					STAT_ADD(ctx, ST_HASHED, 1);
+					continue;
+				}
+				ar[i*cnt + j] = comparePair(ctx, grp[m], files[j], node->size, maxToSkip, ibuff, jbuff);
+				if (ar[i*cnt + j] == FAILED_J) {
+					fileError(ctx, files[j], errno);
+					ar[i*cnt + j] = -1;
+					fflags[j] = 1;
+				} else if (ar[i*cnt + j] == FAILED_I) {
+					/* drop the match and try j again with another */
+					fileError(ctx, grp[m], errno);
+					ar[i*cnt + j] = -1;
+					memmove(grp + m, grp + m + 1, (--ng - m) * sizeof (struct fe *));
+					--k;
+				} else if (ar[i*cnt + j] == node->size) {
+					grp[ng++] = files[j];
+					fflags[j] = 1;
+				}
+			}
+			if (ng == 1)
+				ng = 0;   /* every match of fi failed */
+
+			/* If we found dups of fi, that group is complete */
+			if (ng)
+				emitGroup(ctx, node, grp, ng);
+		}
+		free(ibuff);
+		free(jbuff);
+		free(fflags);
+		free(deferred);
+		free(files);
+		free(ar);
+	} else {
+		/* size == 0, so we trivially consider them all dups */
+		for (i = 0, fp = node->files; fp; fp = fp->next)
+			grp[i++] = fp;
+		emitGroup(ctx, node, grp, cnt);
+	}
+
+	if (traceFile) {
+		traceBegin("compare", "bucket", start);
+		traceArgNum("size", node->size);
+		traceArgNum("files", cnt);
+		traceEnd();
+	}
+	PROGRESS_ADD(ctx, bytesDone, (unsigned long long) node->size * cnt - credited);
+	PROGRESS_ADD(ctx, bucketsDone, 1);
+	for (fp = node->files; fp; fp = fp->next)
+		fp->fresh = 0;
+	free(grp);
+}
+
+/* Compare scheduling. Each bucket is queued on the device holding its first
+ * file, and each device lets at most depth buckets touching it run at once.
+ * A bucket spanning several devices takes a slot on every one of them, and
+ * idle devices get first pick, so both sides of cross-device pairs stay busy.
+ */
+
+/* queue depth defaults; override with finddups_set_depths */
+#define HDD_DEPTH 1
+#define SSD_DEPTH 4
+
+/* how far past the head of a device queue to look for a runnable bucket */
+#define SCHED_LOOKAHEAD 16
+
+/* record distinct devices holding files of bucket, and queue bucket on the first */
+static void queueBucket(struct finddups *ctx, struct Node *node)
+{
+	struct devInfo *d;
+	struct fe *fp;
+	int k;
+	node->devs = Malloc(node->c * sizeof (struct devInfo *));
+	node->ndevs = 0;
+	for (fp = node->files; fp; fp = fp->next) {
+		d = getDevice(ctx, fp->dev);
+		for (k = 0; k < node->ndevs && node->devs[k] != d; ++k);
+		if (k == node->ndevs)
+			node->devs[node->ndevs++] = d;
+	}
+	d = node->devs[0];
+	if (d->qlen == d->qmax) {
+		d->qmax = d->qmax ? d->qmax * 2 : 64;
+		d->q = realloc(d->q, d->qmax * sizeof (struct Node *));
+		if (!d->q)
+			exit(2);
+	}
+	d->q[d->qlen++] = node;
+	node->resolving = 1;
+	++ctx->pending;
+}
+
+static int canStart(struct Node *node)
+{
+	int k;
+	for (k = 0; k < node->ndevs; ++k)
+		if (node->devs[k]->busy >= node->devs[k]->depth)
+			return 0;
+	return 1;
+}
+
+/* pick next bucket to check, favoring the least busy device.
+ * Must hold schedLock. Returns NULL if nothing can start right now.
+ */
+static struct Node *nextBucket(struct finddups *ctx)
+{
+	struct devInfo *d, *best = NULL;
+	struct Node *node;
+	long k, bestk = 0;
+	for (d = ctx->devices; d; d = d->next) {
+		if (d->qhead == d->qlen || d->busy >= d->depth)
+			continue;
+		if (best && d->busy * best->depth >= best->busy * d->depth)
+			continue;
+		for (k = d->qhead; k < d->qlen && k < d->qhead + SCHED_LOOKAHEAD; ++k)
+			if (canStart(d->q[k]))
+				break;
+		if (k < d->qlen && k < d->qhead + SCHED_LOOKAHEAD) {
+			best = d;
+			bestk = k;
+		}
+	}
+	if (!best)
+		return NULL;
+	node = best->q[bestk];
+	memmove(best->q + best->qhead + 1, best->q + best->qhead, (bestk - best->qhead) * sizeof (struct Node *));
+	++best->qhead;
+	return node;
+}
+
+static void *compareWorker(void *arg)
+{
+	struct finddups *ctx = arg;
+	struct devInfo **devs;
+	struct Node *node;
+	int k, ndevs;
+
+	pthread_mutex_lock(&ctx->schedLock);
+	while (ctx->pending) {
+		if (!(node = nextBucket(ctx))) {
+			pthread_cond_wait(&ctx->schedCond, &ctx->schedLock);
+			continue;
+		}
+		--ctx->pending;
+		devs = node->devs;
+		ndevs = node->ndevs;
+		for (k = 0; k < ndevs; ++k)
+			++devs[k]->busy;
+		pthread_mutex_unlock(&ctx->schedLock);
+
+		chkBucket(ctx, node);
+
+		pthread_mutex_lock(&ctx->schedLock);
+		for (k = 0; k < ndevs; ++k)
+			--devs[k]->busy;
+		free(devs);
+		node->devs = NULL;
+		node->resolving = 0;
+		freePartial(node->partial);
+		node->partial = NULL;
+		pthread_cond_broadcast(&ctx->schedCond);
+	}
+	--ctx->running;
+	pthread_cond_broadcast(&ctx->schedCond);
+	pthread_mutex_unlock(&ctx->schedLock);
+	return NULL;
+}
+
+/* check changed buckets for duplicates, emitting groups as they resolve.
+ * With physical ordering, files within each bucket, and the buckets queued
+ * on each device, are visited in order of on-disk location; AUTO does so
+ * only for buckets and devices that involve a rotational disk.
+ */
+static void chkForDups(struct finddups *ctx) {
+	struct Node **buckets;
+	struct devInfo *d;
+	struct fe *fp;
+	pthread_t *threads;
+	struct timespec deadline;
+	unsigned long long bytes = 0;
+	long b, nbuckets;
+	int physical, nthreads, t;
+
+	collectBuckets(ctx, ctx->root);
+	buckets = ctx->buckets;
+	/* groups are found afresh, or taken from the snapshot */
+	for (b = nbuckets = 0; b < ctx->nbuckets; ++b) {
+		freeGroups(buckets[b]);
+		if (!bucketAllowed(ctx, buckets[b])) {
+			STAT_ADD(ctx, ST_PRUNED, 1);
+			for (fp = buckets[b]->files; fp; fp = fp->next)
+				fp->fresh = 0;
+		} else if (!snapReplay(ctx, buckets[b]))
+			buckets[nbuckets++] = buckets[b];
+	}
+	ctx->nbuckets = nbuckets;
+	for (b = 0; b < nbuckets; ++b)
+		bytes += (unsigned long long) buckets[b]->size * buckets[b]->c;
+	__atomic_store_n(&ctx->progress.buckets, nbuckets, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->progress.bucketsDone, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->progress.bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->progress.bytesDone, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->progress.comparing, 1, __ATOMIC_RELEASE);
+
+	/* In AUTO, only a bucket with a file on a rotational device is worth
+	 * looking up locations for; the rest keep the order they have.
+	 */
+	for (b = 0; b < nbuckets; ++b) {
+		if (!buckets[b]->size) {
+			buckets[b]->files->loc = 0;
+			continue;
+		}
+		physical = ctx->order == FINDDUPS_ORDER_PHYSICAL;
+		for (fp = buckets[b]->files; fp && !physical && ctx->order == FINDDUPS_ORDER_AUTO; fp = fp->next)
+			physical = getDevice(ctx, fp->dev)->rotational;
+		if (physical)
+			sortByLoc(ctx, buckets[b]);
+	}
+
+	for (b = 0; b < nbuckets; ++b)
+		queueBucket(ctx, buckets[b]);
+	ctx->nbuckets = 0;
+	/* buckets queued on a rotational device start with a file on it, so
+	 * were sorted above; taking them in order of location sweeps the disk
+	 */
+	for (d = ctx->devices; d; d = d->next)
+		if (d->qlen > 1 && (ctx->order == FINDDUPS_ORDER_PHYSICAL
+					|| (ctx->order == FINDDUPS_ORDER_AUTO && d->rotational))) {
+			DEBUG_PRINT("Ordering reads by physical location\n");
+			qsort(d->q, d->qlen, sizeof (struct Node *), cmpBucketLoc);
+		}
+
+	/* Buckets compared pairwise get their files in the order rows go by:
+	 * candidates first, so that rows of reference files have nothing left
+	 * to compare, or as a checkpoint left them. Lists are relinked only
+	 * here, while nothing else walks them.
+	 */
+	for (b = 0; b < nbuckets; ++b) {
+		if (!buckets[b]->size || (unsigned long) buckets[b]->size * buckets[b]->c <= ctx->smallBudget)
+			continue;
+		if (ctx->refs)
+			candidatesFirst(buckets[b]);
+		resumeOrder(ctx, buckets[b]);
+	}
+
+	/* one worker per queue slot, across devices that have work */
+	for (nthreads = 0, d = ctx->devices; d; d = d->next) {
+		d->depth = d->rotational ? ctx->hddDepth : ctx->ssdDepth;
+		if (d->qlen)
+			nthreads += d->depth;
+	}
+	DEBUG_PRINT("Starting %d compare threads\n", nthreads);
+	threads = Malloc((nthreads + 1) * sizeof (pthread_t));
+	ctx->running = nthreads;
+	for (t = 0; t < nthreads; ++t)
+		if (pthread_create(&threads[t], NULL, compareWorker, ctx))
+			error_exit("Error creating compare thread", NULL);
+	/* checkpoint now and then while the workers go */
+	pthread_mutex_lock(&ctx->schedLock);
+	while (ctx->running) {
+		if (!ctx->checkpointPath) {
+			pthread_cond_wait(&ctx->schedCond, &ctx->schedLock);
+			continue;
+		}
+		deadline.tv_sec = ctx->nextCheckpoint;
+		deadline.tv_nsec = (ctx->nextCheckpoint - deadline.tv_sec) * 1e9;
+		if (pthread_cond_timedwait(&ctx->schedCond, &ctx->schedLock, &deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&ctx->schedLock);
+			checkpoint(ctx);
+			pthread_mutex_lock(&ctx->schedLock);
+		}
+	}
+	pthread_mutex_unlock(&ctx->schedLock);
+	for (t = 0; t < nthreads; ++t)
+		pthread_join(threads[t], NULL);
+	free(threads);
+	__atomic_store_n(&ctx->progress.comparing, 0, __ATOMIC_RELEASE);
+
+	for (d = ctx->devices; d; d = d->next) {
+		free(d->q);
+		d->q = NULL;
+		d->qhead = d->qlen = d->qmax = 0;
+	}
+}
+
+/* SHA-256 (FIPS 180-4), for content digests of the lookup interface */
+struct sha256 {uint32_t h[8]; unsigned char buf[64]; unsigned long long len;};
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256Block(struct sha256 *s, const unsigned char *p)
+{
+	uint32_t w[64], v[8], t1, t2;
+	int k;
+	for (k = 0; k < 16; ++k)
+		w[k] = (uint32_t) p[4*k] << 24 | p[4*k+1] << 16 | p[4*k+2] << 8 | p[4*k+3];
+	for (; k < 64; ++k)
+		w[k] = w[k-16] + (ROR(w[k-15], 7) ^ ROR(w[k-15], 18) ^ w[k-15] >> 3)
+			+ w[k-7] + (ROR(w[k-2], 17) ^ ROR(w[k-2], 19) ^ w[k-2] >> 10);
+	memcpy(v, s->h, sizeof v);
+	for (k = 0; k < 64; ++k) {
+		t1 = v[7] + (ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25))
+			+ ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256K[k] + w[k];
+		t2 = (ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22))
+			+ ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof (uint32_t));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (k = 0; k < 8; ++k)
+		s->h[k] += v[k];
+}
+
+static void sha256Init(struct sha256 *s)
+{
+	static const uint32_t h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	memcpy(s->h, h0, sizeof h0);
+	s->len = 0;
+}
+
+static void sha256Update(struct sha256 *s, const unsigned char *p, size_t n)
+{
+	size_t used = s->len % 64, take;
+	s->len += n;
+	if (used) {
+		take = n < 64 - used ? n : 64 - used;
+		memcpy(s->buf + used, p, take);
+		p += take;
+		n -= take;
+		if (used + take < 64)
+			return;
+		sha256Block(s, s->buf);
+	}
+	for (; n >= 64; p += 64, n -= 64)
+		sha256Block(s, p);
+	memcpy(s->buf, p, n);
+}
+
+static void sha256Final(struct sha256 *s, unsigned char *out)
+{
+	unsigned long long bits = s->len * 8;
+	unsigned char pad[72] = {0x80};
+	int k, npad = 64 - (s->len + 8) % 64;
+	for (k = 0; k < 8; ++k)
+		pad[npad + k] = bits >> (56 - 8 * k);
+	sha256Update(s, pad, npad + 8);
+	for (k = 0; k < 32; ++k)
+		out[k] = s->h[k / 4] >> (24 - 8 * (k % 4));
+}
+
+/* Lookups against the index, for callers answering "is this file already
+ * stored?" one file at a time. Content digests of indexed files are worked
+ * out on first need and kept in their entries.
+ */
+#define DIGEST_CHUNK (64 * 1024)
+
+static struct Node *findNode(struct finddups *ctx, long size)
+{
+	struct Node *node = ctx->root;
+	while (node && node->size != size)
+		node = size < node->size ? node->left : node->right;
+	return node;
+}
+
+/* digest size bytes of named file into out; returns -1 if it cannot be read
+ * in full
+ */
+static int fileDigest(struct finddups *ctx, const char *name, long size, unsigned char *out)
+{
+	struct sha256 s;
+	char *buf;
+	ssize_t nr;
+	long pos;
+	int fd;
+	if ((fd = openFile(ctx, name)) < 0)
+		return -1;
+	buf = Malloc(DIGEST_CHUNK);
+	sha256Init(&s);
+	for (pos = 0; pos < size; pos += nr) {
+		nr = readAt(ctx, fd, buf, size - pos < DIGEST_CHUNK ? size - pos : DIGEST_CHUNK, pos);
+		if (nr <= 0)
+			break;
+		sha256Update(&s, (unsigned char *) buf, nr);
+	}
+	free(buf);
+	closeFile(ctx, fd);
+	if (pos < size)
+		return -1;
+	sha256Final(&s, out);
+	return 0;
+}
+
+/* cached digest of indexed file, or NULL if it cannot be read */
+static const unsigned char *entryDigest(struct finddups *ctx, struct fe *f, long size)
+{
+	if (!f->digest) {
+		f->digest = Malloc(FINDDUPS_DIGEST_LEN);
+		if (fileDigest(ctx, f->name, size, f->digest)) {
+			free(f->digest);
+			f->digest = NULL;
+		}
+	}
+	return f->digest;
+}
+
+static void reportFile(struct fe *f, finddups_file_fn fn, void *arg)
+{
+	struct finddups_file v;
+	v.path = f->name;
+	v.dev = f->dev;
+	v.ino = f->inode;
+	fn(arg, &v);
+}
+
+/* unlink entry from its bucket and the name index, and free it */
+static void dropEntry(struct finddups *ctx, struct fe *f)
+{
+	struct fe **link;
+	struct Node *node = findNode(ctx, f->size);
+	if (ctx->byName) {
+		for (link = &ctx->byName[nameHash(f->name) & ctx->byNameMask]; *link != f; link = &(*link)->nnext);
+		*link = f->nnext;
+		--ctx->byNameCount;
+	}
+	for (link = &node->files; *link != f; link = &(*link)->next);
+	*link = f->next;
+	--node->c;
+	node->dirty = 1;
+	freeGroups(node);
+	f->next = NULL;
+	freeFiles(f);
+}
+
+/* Index files; the layout is in libfinddups.h */
+
+static int cmpSizeDevIno(const void *a, const void *b)
+{
+	const struct fe *x = *(struct fe * const *) a, *y = *(struct fe * const *) b;
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	return cmpDevIno(a, b);
+}
+
+/* write index to path; trailer, if any, appends more after it */
+static int writeIndex(struct finddups *ctx, const char *path, int digests,
+		void (*trailer)(struct finddups *, FILE *))
+{
+	static const char zeros[FINDDUPS_DIGEST_LEN];
+	struct finddups_index_header h;
+	struct finddups_index_entry e;
+	struct fe **all;
+	uint64_t pos;
+	long n = 0, i;
+	char *tmp;
+	FILE *f;
+
+	all = Malloc((countAll(ctx->root) + 1) * sizeof (struct fe *));
+	collectAll(ctx->root, all, &n);
+	qsort(all, n, sizeof (struct fe *), cmpSizeDevIno);
+	for (i = 0; i < n; ++i) {
+		if (digests)
+			entryDigest(ctx, all[i], all[i]->size);
+		digests |= all[i]->digest != NULL;
+	}
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, FINDDUPS_INDEX_MAGIC, sizeof h.magic);
+	h.version = FINDDUPS_INDEX_VERSION;
+	h.byte_order = 0x01020304;
+	h.entries = n;
+	h.entries_offset = sizeof h;
+	h.pool_offset = h.entries_offset + n * sizeof e;
+	for (i = 0; i < n; ++i)
+		h.pool_size += strlen(all[i]->name) + 1;
+	if (digests)
+		h.digests_offset = h.pool_offset + ((h.pool_size + 7) & ~7ULL);
+
+	tmp = Malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	if (!(f = fopen(tmp, "w"))) {
+		free(tmp);
+		free(all);
+		return -1;
+	}
+	fwrite(&h, sizeof h, 1, f);
+	memset(&e, 0, sizeof e);
+	for (i = 0, pos = 0; i < n; ++i) {
+		e.size = all[i]->size;
+		e.dev = all[i]->dev;
+		e.ino = all[i]->inode;
+		e.mtime = all[i]->mtime;
+		e.path = pos;
+		e.flags = (all[i]->sparse ? FINDDUPS_INDEX_SPARSE : 0)
+				| (all[i]->digest ? FINDDUPS_INDEX_DIGEST : 0)
+				| (all[i]->ref ? FINDDUPS_INDEX_REF : 0);
+		e.root = all[i]->root + 1;
+		fwrite(&e, sizeof e, 1, f);
+		pos += strlen(all[i]->name) + 1;
+	}
+	for (i = 0; i < n; ++i)
+		fwrite(all[i]->name, 1, strlen(all[i]->name) + 1, f);
+	if (digests) {
+		fwrite(zeros, 1, -h.pool_size & 7, f);
+		for (i = 0; i < n; ++i)
+			fwrite(all[i]->digest ? (const char *) all[i]->digest : zeros, 1, FINDDUPS_DIGEST_LEN, f);
+	}
+	free(all);
+	if (trailer)
+		trailer(ctx, f);
+	if (ferror(f) | fclose(f) || rename(tmp, path)) {
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* add the files of index at path. Its roots take the ids from base on, or
+ * ones after all roots so far if base is -1.
+ */
+static int readIndex(struct finddups *ctx, const char *path, int base)
+{
+	const struct finddups_index_header *h;
+	const struct finddups_index_entry *e;
+	const char *p, *pool;
+	struct stat st;
+	struct fe *f;
+	uint64_t i, nroots = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) || (p = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	/* check everything entries will point at lies within the file */
+	h = (const void *) p;
+	if ((uint64_t) st.st_size < sizeof *h || memcmp(h->magic, FINDDUPS_INDEX_MAGIC, sizeof h->magic)
+			|| h->version != FINDDUPS_INDEX_VERSION || h->byte_order != 0x01020304
+			|| h->entries_offset % 8 || h->digests_offset % 8
+			|| h->entries_offset > (uint64_t) st.st_size || h->entries > (uint64_t) st.st_size / sizeof *e
+			|| h->entries_offset + h->entries * sizeof *e > (uint64_t) st.st_size
+			|| h->pool_offset > (uint64_t) st.st_size || h->pool_size > st.st_size - h->pool_offset
+			|| (h->pool_size && p[h->pool_offset + h->pool_size - 1])
+			|| (h->digests_offset && (h->digests_offset > (uint64_t) st.st_size
+				|| h->entries > (st.st_size - h->digests_offset) / FINDDUPS_DIGEST_LEN)))
+		goto bad;
+	e = (const void *) (p + h->entries_offset);
+	pool = p + h->pool_offset;
+	for (i = 0; i < h->entries; ++i) {
+		if (e[i].path >= h->pool_size || e[i].root > h->entries)
+			goto bad;
+		if (e[i].root > nroots)
+			nroots = e[i].root;
+	}
+
+	if (!(ctx->maps = realloc(ctx->maps, (ctx->nmaps + 1) * sizeof *ctx->maps)))
+		exit(2);
+	ctx->maps[ctx->nmaps].p = (void *) p;
+	ctx->maps[ctx->nmaps++].len = st.st_size ? st.st_size : 1;
+	/* its roots are new ones, with no path to walk */
+	if (base < 0) {
+		base = ctx->nroots;
+		while ((uint64_t) ctx->nroots < base + nroots) {
+			growRoots(ctx);
+			ctx->rootPaths[ctx->nroots] = NULL;
+			ctx->rootRefs[ctx->nroots++] = 0;
+		}
+	}
+	phaseMark(&ctx->phases[PHASE_SCAN], 1);
+	startHashers(ctx);
+	for (i = 0; i < h->entries; ++i) {
+		STAT_ADD(ctx, ST_FILES, 1);
+		if (!inShard(ctx, e[i].size))
+			continue;
+		f = Malloc(sizeof (struct fe));
+		memset(f, 0, sizeof *f);
+		f->name = pool + e[i].path;
+		f->dev = e[i].dev;
+		f->inode = e[i].ino;
+		f->size = e[i].size;
+		f->mtime = e[i].mtime;
+		f->sparse = e[i].flags & FINDDUPS_INDEX_SPARSE;
+		f->fresh = 1;
+		f->root = e[i].root ? base + (int) e[i].root - 1 : -1;
+		f->ref = e[i].flags & FINDDUPS_INDEX_REF;
+		ctx->refs |= f->ref;
+		f->mapped = MAPPED_NAME;
+		if (h->digests_offset && e[i].flags & FINDDUPS_INDEX_DIGEST) {
+			f->digest = (unsigned char *) p + h->digests_offset + i * FINDDUPS_DIGEST_LEN;
+			f->mapped |= MAPPED_DIGEST;
+		}
+		insertEntry(ctx, f);
+	}
+	phaseMark(&ctx->phases[PHASE_SCAN], 0);
+	return 0;
+bad:
+	munmap((void *) p, st.st_size ? st.st_size : 1);
+	errno = EINVAL;
+	return -1;
+}
+
+/* Checkpoints are index files of the files found so far, with a trailer of
+ * snapshot records (see snapshots above) after the index proper: roots
+ * walked whole, buckets resolved with their groups, and rows done in
+ * buckets being compared. The walking thread writes them during traversal,
+ * and the thread waiting on compare workers during the compare phase.
+ */
+static void checkpointTrailer(struct finddups *ctx, FILE *f)
+{
+	fwrite(SNAP_MAGIC, 1, 8, f);
+	fputc('W', f);
+	put32(f, ctx->rootsWalked);
+	pthread_mutex_lock(&ctx->schedLock);
+	snapSaveBuckets(ctx, f, ctx->root);
+	savePartials(ctx, f, ctx->root);
+	pthread_mutex_unlock(&ctx->schedLock);
+}
+
+static void checkpoint(struct finddups *ctx)
+{
+	double start = traceFile ? wallNow() : 0;
+	if (writeIndex(ctx, ctx->checkpointPath, 0, checkpointTrailer)) {
+		DEBUG_PRINT("Cannot write checkpoint %s\n", ctx->checkpointPath);
+		STAT_ADD(ctx, ST_ERRORS, 1);
+	} else {
+		STAT_ADD(ctx, ST_CHECKPOINTS, 1);
+	}
+	if (traceFile) {
+		traceBegin("checkpoint", ctx->checkpointPath, start);
+		traceEnd();
+	}
+	ctx->nextCheckpoint = wallNow() + ctx->checkpointInterval;
+}
+
+/* load index of checkpoint, then its trailer as a snapshot */
+static int resume(struct finddups *ctx, const char *path)
+{
+	const struct finddups_index_header *h;
+	uint64_t end;
+	size_t len;
+
+	if (ctx->snapBuf) {
+		errno = EBUSY;
+		return -1;
+	}
+	/* the same roots get added again, in the same order */
+	if (readIndex(ctx, path, 0))
+		return -1;
+	h = ctx->maps[ctx->nmaps-1].p;
+	len = ctx->maps[ctx->nmaps-1].len;
+	end = h->digests_offset ? h->digests_offset + h->entries * FINDDUPS_DIGEST_LEN
+			: h->pool_offset + h->pool_size;
+	if (end >= len)
+		return 0;
+	ctx->snapLen = len - end;
+	ctx->snapBuf = memcpy(Malloc(ctx->snapLen), (const char *) h + end, ctx->snapLen);
+	return snapParse(ctx);
+}
+
+/* public interface; see libfinddups.h */
+
+struct finddups *finddups_new(void)
+{
+	struct finddups *ctx = Malloc(sizeof (struct finddups));
+	pthread_condattr_t attr;
+	memset(ctx, 0, sizeof (struct finddups));
+	ctx->io = &backends[0];
+	ctx->smallBudget = SMALL_BUDGET;
+	ctx->order = FINDDUPS_ORDER_AUTO;
+	ctx->hddDepth = HDD_DEPTH;
+	ctx->ssdDepth = SSD_DEPTH;
+	pthread_mutex_init(&ctx->hashLock, NULL);
+	pthread_cond_init(&ctx->hashCond, NULL);
+	pthread_mutex_init(&ctx->schedLock, NULL);
+	pthread_mutex_init(&ctx->failLock, NULL);
+	/* checkpoint deadlines are on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->schedCond, &attr);
+	pthread_condattr_destroy(&attr);
+	return ctx;
+}
+
+void finddups_free(struct finddups *ctx)
+{
+	struct devInfo *d;
+	int k;
+	stopHashers(ctx);
+	freeTree(ctx->root);
+	while ((d = ctx->devices) != NULL) {
+		ctx->devices = d->next;
+		free(d);
+	}
+	free(ctx->buckets);
+	free(ctx->byName);
+	snapFree(ctx);
+	free(ctx->checkpointPath);
+	free(ctx->failed);
+	pthread_mutex_destroy(&ctx->failLock);
+	for (k = 0; k < ctx->nroots; ++k)
+		free(ctx->rootPaths[k]);
+	free(ctx->rootPaths);
+	free(ctx->rootRefs);
+	for (k = 0; k < ctx->nmaps; ++k)
+		munmap(ctx->maps[k].p, ctx->maps[k].len);
+	free(ctx->maps);
+	pthread_mutex_destroy(&ctx->hashLock);
+	pthread_cond_destroy(&ctx->hashCond);
+	pthread_mutex_destroy(&ctx->schedLock);
+	pthread_cond_destroy(&ctx->schedCond);
+	free(ctx);
+}
+
+int finddups_set_backend(struct finddups *ctx, const char *spec)
+{
+	const struct backend *io = findBackend(spec);
+	if (!io)
+		return -1;
+	ctx->io = io;
+	return 0;
+}
+
+void finddups_set_order(struct finddups *ctx, enum finddups_order order)
+{
+	ctx->order = order;
+}
+
+void finddups_set_depths(struct finddups *ctx, int hdd, int ssd)
+{
+	if (hdd > 0)
+		ctx->hddDepth = hdd;
+	if (ssd > 0)
+		ctx->ssdDepth = ssd;
+}
+
+void finddups_set_small_budget(struct finddups *ctx, unsigned long bytes)
+{
+	ctx->smallBudget = bytes;
+}
+
+void finddups_set_hash_threads(struct finddups *ctx, int threads)
+{
+	ctx->hashThreads = threads > 0 ? threads : 0;
+}
+
+void finddups_set_cross_root(struct finddups *ctx, int on)
+{
+	ctx->crossRoot = on;
+}
+
+int finddups_set_shard(struct finddups *ctx, int k, int n)
+{
+	if (n < 0 || (n && (k < 0 || k >= n))) {
+		errno = EINVAL;
+		return -1;
+	}
+	ctx->shard = k;
+	ctx->nshards = n;
+	return 0;
+}
+
+void finddups_set_callback(struct finddups *ctx, finddups_group_fn fn, void *arg)
+{
+	ctx->onGroup = fn;
+	ctx->onGroupArg = arg;
+}
+
+void finddups_set_error_callback(struct finddups *ctx, finddups_error_fn fn, void *arg)
+{
+	ctx->onError = fn;
+	ctx->onErrorArg = arg;
+}
+
+static int addRoot(struct finddups *ctx, const char *path, int ref)
+{
+	int r = rootOf(ctx, path);
+	/* a dir under a root of the same kind added before, such as one
+	 * that turned up later, is part of that root
+	 */
+	ctx->curRoot = r >= 0 && ctx->rootRefs[r] == ref ? r : rootId(ctx, path, ref);
+	/* walked whole before the checkpoint resumed from */
+	if (ctx->skipRoots) {
+		--ctx->skipRoots;
+		++ctx->rootsWalked;
+		return 0;
+	}
+	phaseMark(&ctx->phases[PHASE_SCAN], 1);
+	startHashers(ctx);
+	walking = ctx;
+	if (ctx->snapshotting && ctx->io->walk == posixWalk)
+		r = snapRoot(ctx, path);
+	else
+		r = ctx->io->walk(path, visit);
+	walking = NULL;
+	++ctx->rootsWalked;
+	if (traceFile)
+		traceDirs(0);
+	phaseMark(&ctx->phases[PHASE_SCAN], 0);
+	if (r == -1) {
+		DEBUG_PRINT("returned %d, errno = %d\n", r, errno);
+		STAT_ADD(ctx, ST_ERRORS, 1);
+		return -1;
+	}
+	return 0;
+}
+
+int finddups_add_root(struct finddups *ctx, const char *path)
+{
+	return addRoot(ctx, path, 0);
+}
+
+int finddups_add_ref_root(struct finddups *ctx, const char *path)
+{
+	return addRoot(ctx, path, 1);
+}
+
+int finddups_add_file(struct finddups *ctx, const char *path, const struct stat *st)
+{
+	struct stat sb;
+	if (!st) {
+		if (lstat(path, &sb))
+			return -1;
+		st = &sb;
+	}
+	if (!S_ISREG(st->st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+	startHashers(ctx);
+	STAT_ADD(ctx, ST_FILES, 1);
+	insert(ctx, path, st, rootOf(ctx, path));
+	return 0;
+}
+
+void finddups_run(struct finddups *ctx)
+{
+	stopHashers(ctx);
+	DEBUG_PRINT("Done scanning directory tree. Now starting duplicate checks.\n");
+	phaseMark(&ctx->phases[PHASE_COMPARE], 1);
+	chkForDups(ctx);
+	phaseMark(&ctx->phases[PHASE_COMPARE], 0);
+	while (ctx->nfailed) {
+		snapStale(ctx, ctx->failed[ctx->nfailed-1]->name);
+		dropEntry(ctx, ctx->failed[--ctx->nfailed]);
+	}
+}
+
+const char *finddups_stat_name(int k)
+{
+	return k >= 0 && k < ST_COUNT ? statNames[k] : NULL;
+}
+
+unsigned long long finddups_stat(struct finddups *ctx, int k)
+{
+	return k >= 0 && k < ST_COUNT ? __atomic_load_n(&ctx->stats[k], __ATOMIC_RELAXED) : 0;
+}
+
+const char *finddups_phase(struct finddups *ctx, int k, double *wall, double *cpu)
+{
+	if (k < 0 || k >= PHASE_COUNT)
+		return NULL;
+	/* a phase under way holds minus its start time; report it as 0 */
+	*wall = ctx->phases[k].wall > 0 ? ctx->phases[k].wall : 0;
+	*cpu = ctx->phases[k].cpu > 0 ? ctx->phases[k].cpu : 0;
+	return phaseNames[k];
+}
+
+void finddups_get_progress(struct finddups *ctx, struct finddups_progress *p)
+{
+	p->comparing = __atomic_load_n(&ctx->progress.comparing, __ATOMIC_ACQUIRE);
+	p->buckets = __atomic_load_n(&ctx->progress.buckets, __ATOMIC_RELAXED);
+	p->bucketsDone = __atomic_load_n(&ctx->progress.bucketsDone, __ATOMIC_RELAXED);
+	p->bytes = __atomic_load_n(&ctx->progress.bytes, __ATOMIC_RELAXED);
+	p->bytesDone = __atomic_load_n(&ctx->progress.bytesDone, __ATOMIC_RELAXED);
+}
+
+int finddups_lookup_path(struct finddups *ctx, const char *path, finddups_file_fn fn, void *arg)
+{
+	struct stat st;
+	struct Node *node;
+	struct fe *f, *self = NULL, q;
+	unsigned char qd[FINDDUPS_DIGEST_LEN];
+	const unsigned char *d;
+	char *ibuff, *jbuff;
+	int n = 0;
+
+	if (lstat(path, &st))
+		return -1;
+	if (!S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(node = findNode(ctx, st.st_size)) || !node->files)
+		return 0;
+	for (f = node->files; f && !self; f = f->next)
+		if (f->dev == st.st_dev && f->inode == st.st_ino)
+			self = f;
+	if (self && node->c == 1)
+		return 0;
+
+	/* narrow down by digest, then confirm byte for byte */
+	if (self) {
+		d = entryDigest(ctx, self, node->size);
+	} else {
+		memset(&q, 0, sizeof q);
+		q.name = path;
+		q.dev = st.st_dev;
+		q.inode = st.st_ino;
+		q.sparse = (long long) st.st_blocks * 512 < (long long) st.st_size;
+		self = &q;
+		d = fileDigest(ctx, path, node->size, qd) ? NULL : qd;
+	}
+	if (!d)
+		return -1;
+	ibuff = Malloc(BUFSIZE);
+	jbuff = Malloc(BUFSIZE);
+	for (f = node->files; f; f = f->next) {
+		if (f == self || !entryDigest(ctx, f, node->size)
+				|| memcmp(f->digest, d, FINDDUPS_DIGEST_LEN)
+				|| cmpFiles(ctx, self, f, node->size, 0, ibuff, jbuff) != node->size)
+			continue;
+		reportFile(f, fn, arg);
+		++n;
+	}
+	free(ibuff);
+	free(jbuff);
+	return n;
+}
+
+int finddups_lookup_digest(struct finddups *ctx, long size, const unsigned char *digest,
+		finddups_file_fn fn, void *arg)
+{
+	struct Node *node;
+	struct fe *f;
+	int n = 0;
+	if (!(node = findNode(ctx, size)))
+		return 0;
+	for (f = node->files; f; f = f->next) {
+		if (!entryDigest(ctx, f, size) || memcmp(f->digest, digest, FINDDUPS_DIGEST_LEN))
+			continue;
+		reportFile(f, fn, arg);
+		++n;
+	}
+	return n;
+}
+
+int finddups_remove_file(struct finddups *ctx, const char *path)
+{
+	struct fe **link;
+	/* queued hashes may point at the entry */
+	stopHashers(ctx);
+	if (!*(link = nameFind(ctx, path))) {
+		errno = ENOENT;
+		return -1;
+	}
+	dropEntry(ctx, *link);
+	return 0;
+}
+
+/* entries under dir, collected so they can be dropped afterwards */
+static void collectUnder(struct Node *node, const char *dir, size_t len, struct fe ***v, long *n, long *max)
+{
+	struct fe *f;
+	if (!node)
+		return;
+	for (f = node->files; f; f = f->next) {
+		if (strncmp(f->name, dir, len) || f->name[len] != '/')
+			continue;
+		if (*n == *max) {
+			*max = *max ? *max * 2 : 64;
+			if (!(*v = realloc(*v, *max * sizeof (struct fe *))))
+				exit(2);
+		}
+		(*v)[(*n)++] = f;
+	}
+	collectUnder(node->left, dir, len, v, n, max);
+	collectUnder(node->right, dir, len, v, n, max);
+}
+
+long finddups_remove_tree(struct finddups *ctx, const char *dir)
+{
+	struct fe **v = NULL;
+	long k, n = 0, max = 0;
+	size_t len = strlen(dir);
+	while (len > 1 && dir[len-1] == '/')
+		--len;
+	stopHashers(ctx);
+	collectUnder(ctx->root, dir, len, &v, &n, &max);
+	for (k = 0; k < n; ++k)
+		dropEntry(ctx, v[k]);
+	free(v);
+	return n;
+}
+
+void finddups_set_new_only(struct finddups *ctx, int on)
+{
+	ctx->newOnly = on;
+}
+
+int finddups_snapshot_load(struct finddups *ctx, const char *path)
+{
+	ctx->snapshotting = 1;
+	return snapLoad(ctx, path);
+}
+
+int finddups_snapshot_save(struct finddups *ctx, const char *path)
+{
+	return snapSave(ctx, path);
+}
+
+int finddups_write_index(struct finddups *ctx, const char *path, int digests)
+{
+	return writeIndex(ctx, path, digests, NULL);
+}
+
+int finddups_read_index(struct finddups *ctx, const char *path)
+{
+	return readIndex(ctx, path, -1);
+}
+
+void finddups_set_checkpoint(struct finddups *ctx, const char *path, int seconds)
+{
+	free(ctx->checkpointPath);
+	ctx->checkpointPath = path ? copystr(path) : NULL;
+	ctx->checkpointInterval = seconds > 0 ? seconds : 1;
+	ctx->nextCheckpoint = wallNow() + ctx->checkpointInterval;
+}
+
+int finddups_resume(struct finddups *ctx, const char *path)
+{
+	return resume(ctx, path);
+}
+
+#if defined(FINDDUPS_BENCH)
+long finddups_bench_compare(struct finddups *ctx, const char *a, const char *b, long size,
+		size_t bufsize, size_t (*kernel)(const char *, const char *, size_t), char *abuf, char *bbuf)
+{
+	struct fe fa, fb;
+	memset(&fa, 0, sizeof fa);
+	memset(&fb, 0, sizeof fb);
+	fa.name = a;
+	fb.name = b;
+	fa.size = fb.size = size;
+	benchBufsize = bufsize;
+	benchKernel = kernel;
+	return cmpFiles(ctx, &fa, &fb, size, 0, abuf, bbuf);
+}
+#endif
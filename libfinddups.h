@@ -0,0 +1,247 @@
+/* libfinddups - find duplicate files, for embedding in other programs
+ *
+ * Copyright 2012, Alex Stangl
+ * License: OpenBSD/ISC.  See file LICENSE for full text of license.
+ *
+ * A context holds an index of files by size. Files get into it by walking
+ * roots or adding them one at a time; finddups_run then compares the
+ * buckets of same-size files that changed since the last run, and hands
+ * each group of duplicates to a callback as soon as it is resolved.
+ * The index stays warm between runs, so a long-lived caller adds new files
+ * and runs again without rescanning what it already has.
+ *
+ * Typical use:
+ *	struct finddups *fd = finddups_new();
+ *	finddups_set_callback(fd, onGroup, arg);
+ *	finddups_add_root(fd, "/srv/archive");
+ *	finddups_run(fd);
+ *	...
+ *	finddups_free(fd);
+ *
+ * A context must not be used from more than one thread at a time; it runs
+ * threads of its own for hashing and comparing.
+ */
+
+#ifndef LIBFINDDUPS_H
+#define LIBFINDDUPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct finddups;
+
+/* one file of a duplicate group */
+struct finddups_file {const char *path; dev_t dev; ino_t ino;};
+
+/* Called once per group of n duplicate files of the given size. It may be
+ * called from several compare threads at once, and files is only valid
+ * during the call. A group is reported again, in full, by any later run
+ * after a file of the same size was added, unless finddups_set_new_only
+ * limits reports to groups that include such a file.
+ */
+typedef void (*finddups_group_fn)(void *arg, long size, const struct finddups_file *files, int n);
+
+/* Called for each file that cannot be opened or read while comparing, with
+ * its errno, possibly from several compare threads at once. The file is left
+ * out of its bucket from then on, and out of the index once the run ends.
+ */
+typedef void (*finddups_error_fn)(void *arg, const char *path, int err);
+
+/* how compare reads are ordered; AUTO orders by on-disk location only when a
+ * bucket touches a rotational device
+ */
+enum finddups_order {FINDDUPS_ORDER_AUTO, FINDDUPS_ORDER_PHYSICAL, FINDDUPS_ORDER_NONE};
+
+/* compare progress of the current or last run; bytes is the content of all
+ * buckets being compared, which bounds what each file needs read
+ */
+struct finddups_progress {
+	int comparing;
+	unsigned long long buckets, bucketsDone, bytes, bytesDone;
+};
+
+struct finddups *finddups_new(void);
+void finddups_free(struct finddups *fd);
+
+/* Settings; change them only between runs. */
+
+/* select I/O backend by NAME[:ARGS] (posix, mmap, io_uring, mem); returns -1
+ * if unknown or it cannot start here. Backend arguments are process-wide.
+ */
+int finddups_set_backend(struct finddups *fd, const char *spec);
+void finddups_set_order(struct finddups *fd, enum finddups_order order);
+/* buckets compared at once per rotational and per other device, which sets
+ * the number of compare threads; 0 leaves a depth as it is
+ */
+void finddups_set_depths(struct finddups *fd, int hdd, int ssd);
+/* buckets whose files total at most this many bytes are read whole into
+ * memory and grouped there
+ */
+void finddups_set_small_budget(struct finddups *fd, unsigned long bytes);
+/* threads hashing file prefixes in the background while files are added;
+ * 0 (the default) turns this off
+ */
+void finddups_set_hash_threads(struct finddups *fd, int threads);
+/* Keep only files whose size falls in shard k of n (0 <= k < n), spread by a
+ * hash of the size, so that n contexts given the same files split the index
+ * and the comparing between them with no bucket split across two. n of 0
+ * keeps every size. Set before adding files; returns -1 if k or n is out of
+ * range.
+ */
+int finddups_set_shard(struct finddups *fd, int k, int n);
+void finddups_set_callback(struct finddups *fd, finddups_group_fn fn, void *arg);
+void finddups_set_error_callback(struct finddups *fd, finddups_error_fn fn, void *arg);
+/* report only groups that include a file added since the previous run */
+void finddups_set_new_only(struct finddups *fd, int on);
+/* Cross-root mode: report only what files under one root duplicate under
+ * another. Files are compared only with files of other roots, a bucket of
+ * one root's files is not read at all, and a group must span roots. Roots
+ * are told apart by the order they were first added in; a file added on
+ * its own belongs to the innermost root holding its path, and an index
+ * file read keeps its roots apart from all others.
+ */
+void finddups_set_cross_root(struct finddups *fd, int on);
+
+/* add every regular file under path; returns -1 if path cannot be walked.
+ * A path under a root of the same kind added before is part of that root.
+ */
+int finddups_add_root(struct finddups *fd, const char *path);
+/* the same for a reference root: a tree already free of duplicates, such as
+ * a content store. Its files are compared only with candidates (files of
+ * other roots), never with each other, buckets without a candidate are not
+ * read, and only groups with a candidate are reported.
+ */
+int finddups_add_ref_root(struct finddups *fd, const char *path);
+/* add one file, with st from lstat, or NULL to have it looked up. Returns -1
+ * if it cannot be, or it is not a regular file.
+ */
+int finddups_add_file(struct finddups *fd, const char *path, const struct stat *st);
+
+/* compare buckets changed since the last run, reporting duplicate groups */
+void finddups_run(struct finddups *fd);
+
+/* Lookups, for asking whether a file is already in the index. Matches are
+ * passed to fn one at a time and the count of them returned, or -1 if the
+ * query file cannot be read. Digests are SHA-256 of the whole content; those
+ * of indexed files are computed on first need and cached. A size with no
+ * indexed files answers without any reads.
+ */
+#define FINDDUPS_DIGEST_LEN 32
+typedef void (*finddups_file_fn)(void *arg, const struct finddups_file *file);
+
+/* indexed files with the same content as the file at path, excluding path
+ * itself and its hard links; confirmed byte for byte
+ */
+int finddups_lookup_path(struct finddups *fd, const char *path, finddups_file_fn fn, void *arg);
+/* indexed files of given size whose content has the given digest */
+int finddups_lookup_digest(struct finddups *fd, long size, const unsigned char *digest,
+		finddups_file_fn fn, void *arg);
+/* drop file from the index, by the path it was added under; returns -1 if
+ * it is not there. The first removal builds an index by path.
+ */
+int finddups_remove_file(struct finddups *fd, const char *path);
+/* drop every file under dir; returns how many */
+long finddups_remove_tree(struct finddups *fd, const char *dir);
+
+/* Snapshots let a walk skip directories unchanged since the last one, and a
+ * run skip buckets whose files are all the same as then; see README for what
+ * that may miss. snapshot_load reads one, and makes later walks and runs
+ * keep what snapshot_save writes even if path could not be read (on a first
+ * run, say), in which case it returns -1. Load before adding roots. Walks
+ * through the mem backend neither use nor record snapshots.
+ */
+int finddups_snapshot_load(struct finddups *fd, const char *path);
+/* returns -1 if path cannot be written */
+int finddups_snapshot_save(struct finddups *fd, const char *path);
+
+/* Index files hold the scan result in a form that later runs and other
+ * processes can map and use as is: this header, then the entries sorted by
+ * size and then dev/inode, then a pool of NUL-terminated paths, then, if
+ * digests_offset is not 0, a FINDDUPS_DIGEST_LEN digest slot per entry.
+ * Sections start 8-byte aligned. Integers are in the writer's byte order;
+ * byte_order reads 0x01020304 when that is the reader's too.
+ */
+#define FINDDUPS_INDEX_MAGIC "FDINDEX"
+#define FINDDUPS_INDEX_VERSION 1
+struct finddups_index_header {
+	char magic[8];
+	uint32_t version, byte_order;
+	uint64_t entries, entries_offset, pool_offset, pool_size, digests_offset;
+};
+#define FINDDUPS_INDEX_SPARSE 1      /* file has holes */
+#define FINDDUPS_INDEX_DIGEST 2      /* its digest slot is filled in */
+#define FINDDUPS_INDEX_REF 4         /* found under a reference root */
+struct finddups_index_entry {
+	uint64_t size, dev, ino;
+	int64_t mtime;                   /* nanoseconds since the epoch */
+	uint64_t path;                   /* offset in the pool */
+	uint32_t flags;
+	uint32_t root;                   /* root found under, from 1; 0 if none */
+};
+
+/* write index of every file in the context, replacing path only once it is
+ * complete. Digests already known are included; with digests set, all the
+ * rest are computed first, which reads every file. Returns -1 on failure.
+ */
+int finddups_write_index(struct finddups *fd, const char *path, int digests);
+/* add the files of an index, without walking anything; paths and digests
+ * stay in the mapped file. Returns -1 if it cannot be mapped or is not an
+ * index of this version and byte order.
+ */
+int finddups_read_index(struct finddups *fd, const char *path);
+
+/* Checkpoints, for resuming a long run that was cut short. With a path
+ * set, walks and runs write a checkpoint there every so many seconds: an
+ * index file of the files found so far, followed by which roots were walked
+ * whole, the buckets resolved with their groups, and how far each large
+ * bucket under way had got. NULL turns them off.
+ */
+void finddups_set_checkpoint(struct finddups *fd, const char *path, int seconds);
+/* add the files of a checkpoint; then the next add_root calls skip the
+ * roots it had walked whole, and the next run reports the groups of buckets
+ * it had resolved without comparing them, and takes large buckets up from
+ * where it was. Add the same roots in the same order as the run that wrote
+ * it. Returns -1 if path cannot be read, or after finddups_snapshot_load.
+ */
+int finddups_resume(struct finddups *fd, const char *path);
+
+/* counters, kept over the life of the context. Names run out at NULL. */
+const char *finddups_stat_name(int k);
+unsigned long long finddups_stat(struct finddups *fd, int k);
+/* wall and CPU seconds spent in phase k (scan, compare); returns its name,
+ * or NULL past the last phase
+ */
+const char *finddups_phase(struct finddups *fd, int k, double *wall, double *cpu);
+/* safe to call from another thread while a run is going */
+void finddups_get_progress(struct finddups *fd, struct finddups_progress *p);
+
+/* Chrome trace-event timeline of directories, buckets, pairs and reads, for
+ * all contexts in the process; returns -1 if path cannot be created
+ */
+int finddups_trace_open(const char *path);
+void finddups_trace_close(void);
+
+/* write s as a JSON string through put. Valid UTF-8 is copied as is and
+ * control characters are written as \u00XX. Each byte XX that is not part
+ * of valid UTF-8 is written as \udcXX, a lone low surrogate, as Python's
+ * surrogateescape does: the output is valid JSON, no two names give the
+ * same string, and the bytes of the name come back by mapping U+DC80 to
+ * U+DCFF back to bytes 0x80 to 0xFF (os.fsencode in Python)
+ */
+void finddups_json(void (*put)(const char *, size_t), const char *s);
+
+#if defined(FINDDUPS_BENCH)
+/* for bench/cmpbench.c, with the library built with -DFINDDUPS_BENCH: one
+ * compare of files a and b of size bytes through the pairwise compare path
+ * and fd's backend, reading bufsize bytes at a time into abuf and bbuf and
+ * finding differences with kernel (NULL for the built-in one). Returns the
+ * offset of the first difference, size if there is none, or a negative
+ * value with errno set if a file cannot be read.
+ */
+long finddups_bench_compare(struct finddups *fd, const char *a, const char *b, long size,
+		size_t bufsize, size_t (*kernel)(const char *, const char *, size_t), char *abuf, char *bbuf);
+#endif
+
+#endif